@@ -0,0 +1,384 @@
+/* TinyFS benchmarks
+ *
+ * Runs microbenchmarks against a fresh disk image and prints the results
+ * as one JSON document. Each scenario reports its calls, errors, calls per
+ * second, latency percentiles and the blocks read and written per call,
+ * counted by libDisk across the timed calls only. Random choices come from
+ * a seeded xorshift generator, so a seed always replays the same calls.
+ * Putting the image on a RAM disk (/dev/shm) or a regular file system
+ * compares backends.
+ *
+ * Usage: bench [-s seed] [-o opts] [-n scale] diskname
+ *   -s  seed of the random choices (default 1)
+ *   -o  mount options, e.g. 16 for TFS_WRITEBACK (default 0)
+ *   -n  multiplies the number of calls of every scenario (default 1)
+ *
+ * Exit status: 0 done, 8 failure
+ */
+
+#include <unistd.h>
+
+#include "libTinyFS.h"
+
+#define BENCH_CALLS 20000  // timed calls of a read or lookup scenario
+#define FILE_BYTES 12000   // size of the file read by read scenarios
+#define CHUNK 256          // bytes per tfs_read()
+#define CHURN_FILES 30     // files rewritten by churn and defrag aging
+#define CHURN_BYTES 2000   // largest file written by churn
+
+typedef struct Bench {
+    char *diskname;
+    int opts;        // mount options of every fresh disk
+    int scale;       // multiplies calls
+    uint32_t rand;   // xorshift state
+    int64_t *lat;    // ns of each timed call of the scenario
+    int n;           // timed calls so far
+    int max;         // room in lat
+    int errs;        // timed calls that returned an error
+    uint64_t blocksRead;     // blocks read by timed calls
+    uint64_t blocksWritten;  // blocks written by timed calls
+    int first;       // no result printed yet
+} Bench;
+
+// Start of a timed call
+typedef struct Tick {
+    int64_t ns;
+    DiskCounters io;
+} Tick;
+
+/*
+ * Returns the monotonic clock in nanoseconds
+ */
+int64_t nowNs() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Starts a timed call
+ */
+Tick tick() {
+    Tick start;
+
+    diskCounters(&start.io);
+    start.ns = nowNs();
+    return start;
+}
+
+/*
+ * Returns the next random number below n, the same on every platform
+ */
+int nextRand(Bench *b, int n) {
+    b->rand ^= b->rand << 13;
+    b->rand ^= b->rand >> 17;
+    b->rand ^= b->rand << 5;
+    return b->rand % n;
+}
+
+/*
+ * Makes and mounts a fresh disk and starts a scenario with room for
+ * calls timed calls
+ */
+int startScenario(Bench *b, int calls) {
+    tfs_unmount();
+    if (tfs_mkfs(b->diskname, DMAP_SIZE * BLOCKSIZE) < 0 ||
+        tfs_mountOpts(b->diskname, b->opts) < 0) {
+        fprintf(stderr, "bench: cannot make disk '%s'\n", b->diskname);
+        return -1;
+    }
+    free(b->lat);
+    b->lat = malloc(calls * sizeof(int64_t));
+    b->max = calls;
+    b->n = 0;
+    b->errs = 0;
+    b->blocksRead = 0;
+    b->blocksWritten = 0;
+    return b->lat == NULL ? -1 : 0;
+}
+
+/*
+ * Records a timed call that started at start and returned res
+ */
+void timed(Bench *b, Tick start, int res) {
+    int64_t lat = nowNs() - start.ns;
+    DiskCounters io;
+
+    diskCounters(&io);
+    b->blocksRead += io.blocksRead - start.io.blocksRead;
+    b->blocksWritten += io.blocksWritten - start.io.blocksWritten;
+    if (b->n < b->max) {
+        b->lat[b->n++] = lat;
+    }
+    b->errs += res < 0;
+}
+
+int cmpLat(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Prints the result of the scenario as a JSON object
+ */
+void report(Bench *b, char *name, int files) {
+    int64_t total = 0;
+    int n = b->n;
+
+    qsort(b->lat, n, sizeof(int64_t), cmpLat);
+    for (int i = 0; i < n; i++) {
+        total += b->lat[i];
+    }
+
+    printf("%s\n    {\"name\": \"%s\", \"files\": %d, \"calls\": %d, ",
+           b->first ? "" : ",", name, files, n);
+    printf("\"errors\": %d, \"calls_per_sec\": %.1f, \"mean_ns\": %.0f, ",
+           b->errs, total > 0 ? n * 1e9 / total : 0.0,
+           n > 0 ? (double)total / n : 0.0);
+    printf("\"p50_ns\": %lld, \"p90_ns\": %lld, \"p99_ns\": %lld, ",
+           n > 0 ? (long long)b->lat[(n - 1) * 50 / 100] : 0,
+           n > 0 ? (long long)b->lat[(n - 1) * 90 / 100] : 0,
+           n > 0 ? (long long)b->lat[(n - 1) * 99 / 100] : 0);
+    printf("\"max_ns\": %lld, \"blocks_read_per_call\": %.2f, ",
+           n > 0 ? (long long)b->lat[n - 1] : 0,
+           n > 0 ? (double)b->blocksRead / n : 0.0);
+    printf("\"blocks_written_per_call\": %.2f}",
+           n > 0 ? (double)b->blocksWritten / n : 0.0);
+    b->first = 0;
+}
+
+/*
+ * Reads one file a byte or a chunk at a time, in order or at random
+ * offsets. Random reads time the seek and the read as one call
+ */
+int benchRead(Bench *b, int chunk, int random, char *name) {
+    char buf[FILE_BYTES];
+    int calls = BENCH_CALLS * b->scale;
+    Tick start;
+    int pos = 0;
+    int res;
+
+    if (startScenario(b, calls) < 0) {
+        return -1;
+    }
+    memset(buf, 'r', sizeof(buf));
+    fileDescriptor fd = tfs_openFile("read");
+    tfs_writeFile(fd, buf, sizeof(buf));
+
+    for (int i = 0; i < calls; i++) {
+        int offset = random ? nextRand(b, FILE_BYTES - chunk) : -1;
+
+        start = tick();
+        if (offset >= 0) {
+            tfs_seek(fd, offset);
+        }
+        if (chunk == 1) {
+            res = tfs_readByte(fd, buf);
+        } else {
+            res = tfs_read(fd, buf, chunk);
+        }
+        timed(b, start, res);
+
+        // sequential reads start over before the end of the file
+        pos += chunk;
+        if (offset < 0 && pos + chunk > FILE_BYTES) {
+            tfs_seek(fd, 0);
+            pos = 0;
+        }
+    }
+    report(b, name, 1);
+    return 0;
+}
+
+/*
+ * Rewrites one file of size bytes
+ */
+int benchWrite(Bench *b, int size) {
+    char name[32];
+    int calls = BENCH_CALLS / 10 * b->scale;
+    char *buf = malloc(size);
+
+    if (buf == NULL || startScenario(b, calls) < 0) {
+        free(buf);
+        return -1;
+    }
+    memset(buf, 'w', size);
+    fileDescriptor fd = tfs_openFile("write");
+
+    for (int i = 0; i < calls; i++) {
+        Tick start = tick();
+        timed(b, start, tfs_writeFile(fd, buf, size));
+    }
+    free(buf);
+    snprintf(name, sizeof(name), "writeFile_%d", size);
+    report(b, name, 1);
+    return 0;
+}
+
+/*
+ * Looks files up by name, and opens, reads and closes them, on a
+ * disk holding nFiles files
+ */
+int benchOpen(Bench *b, int nFiles) {
+    char name[32];
+    char filename[16];
+    FileInfo info;
+    int calls = BENCH_CALLS * b->scale;
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (startScenario(b, calls) < 0) {
+            return -1;
+        }
+        for (int i = 0; i < nFiles; i++) {
+            snprintf(filename, sizeof(filename), "f%d", i);
+            fileDescriptor fd = tfs_openFile(filename);
+            tfs_writeFile(fd, "x", 1);
+            tfs_closeFile(fd);
+        }
+
+        for (int i = 0; i < calls; i++) {
+            snprintf(filename, sizeof(filename), "f%d", nextRand(b, nFiles));
+            Tick start = tick();
+            if (pass == 0) {
+                timed(b, start, tfs_lookup(filename, &info));
+            } else {
+                fileDescriptor fd = tfs_openFile(filename);
+                int res = tfs_readByte(fd, filename);
+                tfs_closeFile(fd);
+                timed(b, start, fd < 0 ? fd : res);
+            }
+        }
+        snprintf(name, sizeof(name), pass == 0 ? "lookup" : "open_read");
+        report(b, name, nFiles);
+    }
+    return 0;
+}
+
+/*
+ * Deletes a random file and writes it again with a random size, the
+ * two calls are timed as one
+ */
+int churn(Bench *b, fileDescriptor fds[], int calls, int timeIt) {
+    char filename[16];
+    char buf[CHURN_BYTES];
+
+    memset(buf, 'c', sizeof(buf));
+    for (int i = 0; i < calls; i++) {
+        int f = nextRand(b, CHURN_FILES);
+        int size = 1 + nextRand(b, CHURN_BYTES);
+
+        snprintf(filename, sizeof(filename), "c%d", f);
+        Tick start = tick();
+        tfs_deleteFile(fds[f]);
+        fds[f] = tfs_openFile(filename);
+        int res = tfs_writeFile(fds[f], buf, size);
+        if (timeIt) {
+            timed(b, start, res);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Times delete and rewrite churn over CHURN_FILES files
+ */
+int benchChurn(Bench *b) {
+    fileDescriptor fds[CHURN_FILES];
+    char filename[16];
+    int calls = BENCH_CALLS / 10 * b->scale;
+
+    if (startScenario(b, calls) < 0) {
+        return -1;
+    }
+    for (int f = 0; f < CHURN_FILES; f++) {
+        snprintf(filename, sizeof(filename), "c%d", f);
+        fds[f] = tfs_openFile(filename);
+    }
+    churn(b, fds, calls, 1);
+    report(b, "churn", CHURN_FILES);
+    return 0;
+}
+
+/*
+ * Times tfs_defrag() on an image aged by churn before every call
+ */
+int benchDefrag(Bench *b) {
+    fileDescriptor fds[CHURN_FILES];
+    char filename[16];
+    int calls = BENCH_CALLS / 400 * b->scale;
+
+    if (startScenario(b, calls) < 0) {
+        return -1;
+    }
+    for (int f = 0; f < CHURN_FILES; f++) {
+        snprintf(filename, sizeof(filename), "c%d", f);
+        fds[f] = tfs_openFile(filename);
+    }
+    for (int i = 0; i < calls; i++) {
+        churn(b, fds, CHURN_FILES, 0);
+        Tick start = tick();
+        timed(b, start, tfs_defrag());
+    }
+    report(b, "defrag_aged", CHURN_FILES);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Bench b;
+    int fileCounts[] = {10, 30, 100};
+    int sizes[] = {100, 1000, 10000, 60000};
+    int seed = 1;
+    int opt;
+    int res = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.scale = 1;
+    while ((opt = getopt(argc, argv, "s:o:n:")) != -1) {
+        if (opt == 's') {
+            seed = atoi(optarg);
+        } else if (opt == 'o') {
+            b.opts = atoi(optarg);
+        } else if (opt == 'n') {
+            b.scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        } else {
+            fprintf(stderr, "usage: %s [-s seed] [-o opts] [-n scale] "
+                            "diskname\n", argv[0]);
+            return 8;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-s seed] [-o opts] [-n scale] diskname\n",
+                argv[0]);
+        return 8;
+    }
+    b.diskname = argv[optind];
+    b.rand = seed != 0 ? seed : 1;
+    b.first = 1;
+
+    printf("{\n  \"disk\": \"%s\", \"seed\": %d, \"opts\": %d, ",
+           b.diskname, seed, b.opts);
+    printf("\"scale\": %d,\n  \"results\": [", b.scale);
+
+    /* Scenarios */
+    res |= benchRead(&b, 1, 0, "readByte_seq");
+    res |= benchRead(&b, 1, 1, "readByte_rand");
+    res |= benchRead(&b, CHUNK, 0, "read_seq");
+    res |= benchRead(&b, CHUNK, 1, "read_rand");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        res |= benchWrite(&b, sizes[i]);
+    }
+    for (int i = 0; i < (int)(sizeof(fileCounts) / sizeof(fileCounts[0]));
+         i++) {
+        res |= benchOpen(&b, fileCounts[i]);
+    }
+    res |= benchChurn(&b);
+    res |= benchDefrag(&b);
+
+    printf("\n  ]\n}\n");
+    tfs_unmount();
+    free(b.lat);
+    return res < 0 ? 8 : 0;
+}
@@ -1,9 +1,171 @@
+#define _DEFAULT_SOURCE  // preadv and pwritev
 #include "libDisk.h"
 
+// Writes held in memory for one disk, see holdDisk() and cacheDisk()
+static int hDisk = -1;           // disk whose writes are held, -1 if none
+static int hNum = 0;             // blocks of disk that can be held
+static char **hBlocks = NULL;    // held copy of each block, NULL if none
+static unsigned *hVers = NULL;   // times each block was written while held
+static long *hDirtyAt = NULL;    // ms when each held block became dirty
+static int hDirty = 0;           // blocks held
+static unsigned hDropped = 0;    // times held copies were dropped after
+                                 // being written back, see heldGen()
+static int hPinned = 0;          // holdDisk(), nothing is written back
+static int hCached = 0;          // cacheDisk(), flusher writes blocks back
+static int hAgeMs = 0;           // flusher writes blocks held this long
+static int hDirtyPct = 0;        // or everything past this share of hNum
+static int hStop = 0;            // flusher has to exit
+static int hFailed = 0;          // a write-back of the flusher failed since
+                                 // flushDisk() or uncacheDisk() last said so
+static pthread_t hFlusher;
+static pthread_mutex_t hLock = PTHREAD_MUTEX_INITIALIZER;  // guards the above
+static pthread_cond_t hWake = PTHREAD_COND_INITIALIZER;    // wakes flusher
+static pthread_mutex_t hFlushLock = PTHREAD_MUTEX_INITIALIZER;  // 1 flush
+
+// Blocks read and written by the calling thread, see diskCounters()
+static __thread DiskCounters tCounters;
+
+static int newHeld(int disk, int nBlocks);
+static void freeHeld();
+static void stopFlusher();
+static int writeHeld(int minAgeMs);
+static void *flushLoop(void *unused);
+static int takeFailed();
+
+/*
+ * Copies len bytes from src into the segments, starting off bytes
+ * into what they cover
+ */
+static void copyToIov(struct iovec *iov, int iovcnt, size_t off,
+                      const char *src, size_t len) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - off < len ? iov[i].iov_len - off : len;
+        memcpy((char *)iov[i].iov_base + off, src, n);
+        src += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/*
+ * Returns a monotonic clock in milliseconds
+ */
+static long nowMs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Keeps a copy of a held disk's block in place of writing it.
+ * Returns 0 or -1 if there is no memory for the copy
+ */
+static int holdBlock(int bNum, const void *block) {
+    int res = 0;
+
+    pthread_mutex_lock(&hLock);
+    if (hBlocks[bNum] == NULL) {
+        if ((hBlocks[bNum] = malloc(BLOCKSIZE)) == NULL) {
+            pthread_mutex_unlock(&hLock);
+            return -1;
+        }
+        hDirtyAt[bNum] = nowMs();
+        hDirty++;
+        // past the dirty share the flusher writes everything back
+        if (hCached && hDirty * 100 >= hDirtyPct * hNum) {
+            pthread_cond_signal(&hWake);
+        }
+    }
+    memcpy(hBlocks[bNum], block, BLOCKSIZE);
+    hVers[bNum]++;
+    pthread_mutex_unlock(&hLock);
+    return res;
+}
+
+/*
+ * Returns the count of held copies dropped after write-back, taken
+ * before reading the disk. A copy dropped while the read ran may
+ * have been written after the read saw the block, so a read whose
+ * count moved is made again, see countRead()
+ */
+static unsigned heldGen(int disk) {
+    unsigned gen;
+
+    if (disk != hDisk) {
+        return 0;
+    }
+    pthread_mutex_lock(&hLock);
+    gen = hDropped;
+    pthread_mutex_unlock(&hLock);
+    return gen;
+}
+
+/*
+ * Copies held blocks of a held disk over the nBlocks blocks read
+ * into the segments from bNum on, held copies are newer than the
+ * disk. Returns the number of blocks that were held, or -1 if held
+ * copies were dropped since heldGen() returned gen
+ */
+static int overlayHeld(int bNum, int nBlocks, struct iovec *iov, int iovcnt,
+                       unsigned gen) {
+    int hits = 0;
+
+    pthread_mutex_lock(&hLock);
+    if (hDropped != gen) {
+        pthread_mutex_unlock(&hLock);
+        return -1;
+    }
+    for (int i = bNum; i < bNum + nBlocks && i < hNum; i++) {
+        if (hBlocks[i] != NULL) {
+            copyToIov(iov, iovcnt, (size_t)(i - bNum) * BLOCKSIZE,
+                      hBlocks[i], BLOCKSIZE);
+            hits++;
+        }
+    }
+    pthread_mutex_unlock(&hLock);
+    return hits;
+}
+
+/*
+ * Counts nBlocks read from bNum on for the calling thread, overlaying
+ * held copies of a held disk. Blocks served from a held copy are
+ * cache hits, the rest came from the disk. Returns -1 without
+ * counting if the read has to be made again, see heldGen()
+ */
+static int countRead(int disk, int bNum, int nBlocks, struct iovec *iov,
+                     int iovcnt, unsigned gen) {
+    int hits = 0;
+
+    if (disk == hDisk &&
+        (hits = overlayHeld(bNum, nBlocks, iov, iovcnt, gen)) < 0) {
+        return -1;
+    }
+    tCounters.blocksRead += nBlocks;
+    tCounters.cacheHits += hits;
+    tCounters.cacheMisses += nBlocks - hits;
+    return 0;
+}
+
+/*
+ * Description: Copies the block counts of the calling thread, they
+ *              only grow, so callers take the difference around an
+ *              operation
+ * Params: counters (filled with the counts)
+ * Return: None
+ */
+void diskCounters(DiskCounters *counters) { *counters = tCounters; }
+
 /*
  * Description: Create a new disk with inital allocated
  *              space if disk does not already exist. If disk
- *              exist, then just open.
+ *              exist, then just open. New disks are sized with
+ *              ftruncate so the image is sparse and unwritten
+ *              blocks read back as zeros.
  * Params: Filename and nBytes
  * Return: Valid file descriptor or -1 indicating error
  */
@@ -18,6 +180,13 @@ int openDisk(char *filename, int nBytes) {
         // create a new disk file
         fd = open(filename, O_RDWR | O_CREAT | O_TRUNC,
                   0660);  // enable RW for owner, groups, others
+
+        // size disk to a whole number of blocks without writing them
+        if (fd >= 0 &&
+            ftruncate(fd, (off_t)(nBytes / BLOCKSIZE) * BLOCKSIZE) == -1) {
+            close(fd);
+            fd = -1;
+        }
     }
     return fd;
 }
@@ -28,6 +197,11 @@ int openDisk(char *filename, int nBytes) {
  * Return: 0 for sucess or -1 indicating error
  */
 int closeDisk(int disk) {
+    // writes still held for the disk are dropped
+    if (disk == hDisk) {
+        stopFlusher();
+        freeHeld();
+    }
     if (close(disk) == -1) {
         return -1;
     } else {
@@ -51,15 +225,118 @@ int readBlock(int disk, int bNum, void *block) {
     else if (block == NULL) {
         res = -1;
     }
-    // Check if lseek is successful (lseek moves fd over offset amount)
-    else if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) {
+    // Read the block at its offset, pread leaves the fd offset alone.
+    // A held copy is newer than the disk, read again if one was dropped
+    else {
+        struct iovec iov = {block, BLOCKSIZE};
+        unsigned gen;
+        do {
+            gen = heldGen(disk);
+            if (pread(disk, block, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) ==
+                -1) {
+                res = -1;
+                break;
+            }
+        } while (countRead(disk, bNum, 1, &iov, 1, gen) < 0);
+    }
+    return res;
+}
+
+/*
+ * Description: Read a run of consecutive blocks from disk into
+ *              local buf with a single read. Blocks past the end
+ *              of the disk file are returned as zeros.
+ * Params: Disk, bNum (first block number), nBlocks, block (pointer
+ *         to buf of nBlocks * BLOCKSIZE bytes)
+ * Return: Res of 0 for sucess or -1 indicating error
+ */
+int readBlocks(int disk, int bNum, int nBlocks, void *block) {
+    int res = 0;
+    ssize_t nRead;
+    // Check if disk is valid or bNum is negative
+    if (fcntl(disk, F_GETFD) == -1 || bNum < 0 || nBlocks < 0) {
         res = -1;
     }
-    // Read the block
+    // Check if buffer exists
+    else if (block == NULL) {
+        res = -1;
+    }
+    // Read the blocks, again if a held copy was dropped meanwhile
     else {
-        if (read(disk, block, BLOCKSIZE) == -1) {
-            res = -1;
+        size_t len = (size_t)nBlocks * BLOCKSIZE;
+        struct iovec iov = {block, len};
+        unsigned gen;
+        do {
+            gen = heldGen(disk);
+            nRead = pread(disk, block, len, (off_t)bNum * BLOCKSIZE);
+            if (nRead == -1) {
+                res = -1;
+                break;
+            } else if ((size_t)nRead < len) {
+                memset((char *)block + nRead, 0, len - nRead);
+            }
+        } while (countRead(disk, bNum, nBlocks, &iov, 1, gen) < 0);
+    }
+    return res;
+}
+
+/*
+ * Description: Read consecutive blocks from disk straight into
+ *              the caller's segments with preadv, IOV_MAX segments
+ *              per call. Bytes past the end of the disk file are
+ *              returned as zeros.
+ * Params: Disk, bNum (first block number), iov (segments to
+ *         fill in order), iovcnt (number of segments)
+ * Return: Res of 0 for sucess or -1 indicating error
+ */
+int readBlocksv(int disk, int bNum, struct iovec *iov, int iovcnt) {
+    int res = 0;
+    // Check if disk is valid or bNum is negative
+    if (fcntl(disk, F_GETFD) == -1 || bNum < 0 || iovcnt < 0) {
+        res = -1;
+    }
+    // Check if segments exist
+    else if (iov == NULL && iovcnt > 0) {
+        res = -1;
+    }
+    // Read into the segments, again if a held copy was dropped meanwhile
+    else {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            len += iov[i].iov_len;
         }
+        unsigned gen;
+        int again;
+        do {
+            gen = heldGen(disk);
+            int eof = 0;
+            off_t off = (off_t)bNum * BLOCKSIZE;
+            for (int i = 0; i < iovcnt && res == 0; i += IOV_MAX) {
+                int cnt = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+                ssize_t nRead = 0;
+                if (!eof &&
+                    (nRead = preadv(disk, iov + i, cnt, off)) == -1) {
+                    res = -1;
+                    break;
+                }
+                off += nRead;
+                // zero the part of the segments a short read left unfilled
+                for (int j = i; j < i + cnt; j++) {
+                    if ((size_t)nRead >= iov[j].iov_len) {
+                        nRead -= iov[j].iov_len;
+                    } else {
+                        memset((char *)iov[j].iov_base + nRead, 0,
+                               iov[j].iov_len - nRead);
+                        nRead = 0;
+                        eof = 1;
+                    }
+                }
+            }
+            // held copies are newer than the disk
+            again = res == 0 &&
+                    countRead(disk, bNum, (len + BLOCKSIZE - 1) / BLOCKSIZE,
+                              iov, iovcnt, gen) < 0;
+        } while (again);
     }
     return res;
 }
@@ -81,15 +358,425 @@ int writeBlock(int disk, int bNum, void *block) {
     else if (block == NULL) {
         res = -1;
     }
-    // Check if lseek is successful (lseek moves fd over offset amount)
-    else if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) {
+    // Hold the block while writes to the disk are held
+    else if (disk == hDisk && bNum < hNum) {
+        res = holdBlock(bNum, block);
+    }
+    // Write to the block at its offset, pwrite leaves the fd offset alone
+    else if (pwrite(disk, block, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) == -1) {
         res = -1;
     }
-    // Write to the block
+    if (res == 0) {
+        tCounters.blocksWritten++;
+    }
+    return res;
+}
+
+/*
+ * Description: Write a run of consecutive blocks from local buf
+ *              into disk with a single write.
+ * Params: Disk, bNum (first block number), nBlocks, block (pointer
+ *         to buf of nBlocks * BLOCKSIZE bytes)
+ * Return: Res of 0 for sucess or -1 indicating error
+ */
+int writeBlocks(int disk, int bNum, int nBlocks, void *block) {
+    int res = 0;
+    // Check if disk is valid or bNum is negative
+    if (fcntl(disk, F_GETFD) == -1 || bNum < 0 || nBlocks < 0) {
+        res = -1;
+    }
+    // Check if buffer exists
+    else if (block == NULL) {
+        res = -1;
+    }
+    // Hold the blocks while writes to the disk are held
+    else if (disk == hDisk) {
+        for (int i = 0; i < nBlocks && res == 0; i++) {
+            res = writeBlock(disk, bNum + i, (char *)block + i * BLOCKSIZE);
+        }
+    }
+    // Write the blocks
     else {
-        if (write(disk, block, BLOCKSIZE) == -1) {
+        size_t len = (size_t)nBlocks * BLOCKSIZE;
+        if (pwrite(disk, block, len, (off_t)bNum * BLOCKSIZE) != (ssize_t)len) {
             res = -1;
+        } else {
+            tCounters.blocksWritten += nBlocks;
         }
     }
     return res;
 }
+
+/*
+ * Description: Write the caller's segments into consecutive blocks
+ *              with pwritev, IOV_MAX segments per call.
+ * Params: Disk, bNum (first block number), iov (segments to write
+ *         in order), iovcnt (number of segments)
+ * Return: Res of 0 for sucess or -1 indicating error
+ */
+int writeBlocksv(int disk, int bNum, struct iovec *iov, int iovcnt) {
+    int res = 0;
+    // Check if disk is valid or bNum is negative
+    if (fcntl(disk, F_GETFD) == -1 || bNum < 0 || iovcnt < 0) {
+        res = -1;
+    }
+    // Check if segments exist
+    else if (iov == NULL && iovcnt > 0) {
+        res = -1;
+    }
+    // Hold the blocks while writes to the disk are held
+    else if (disk == hDisk) {
+        char buf[BLOCKSIZE];
+        size_t fill = 0;
+        for (int i = 0; i < iovcnt && res == 0; i++) {
+            for (size_t off = 0; off < iov[i].iov_len && res == 0;) {
+                size_t n = iov[i].iov_len - off;
+                if (n > BLOCKSIZE - fill) {
+                    n = BLOCKSIZE - fill;
+                }
+                memcpy(buf + fill, (char *)iov[i].iov_base + off, n);
+                fill += n;
+                off += n;
+                if (fill == BLOCKSIZE) {
+                    res = writeBlock(disk, bNum++, buf);
+                    fill = 0;
+                }
+            }
+        }
+        // a partly written last block keeps the rest of its bytes
+        if (res == 0 && fill > 0) {
+            char last[BLOCKSIZE];
+            if ((res = readBlock(disk, bNum, last)) == 0) {
+                memcpy(last, buf, fill);
+                res = writeBlock(disk, bNum, last);
+            }
+        }
+    }
+    // Write the segments
+    else {
+        off_t off = (off_t)bNum * BLOCKSIZE;
+        for (int i = 0; i < iovcnt && res == 0; i += IOV_MAX) {
+            int cnt = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+            size_t len = 0;
+            for (int j = i; j < i + cnt; j++) {
+                len += iov[j].iov_len;
+            }
+            if (pwritev(disk, iov + i, cnt, off) != (ssize_t)len) {
+                res = -1;
+            }
+            off += len;
+        }
+        if (res == 0) {
+            tCounters.blocksWritten +=
+                (off - (off_t)bNum * BLOCKSIZE + BLOCKSIZE - 1) / BLOCKSIZE;
+        }
+    }
+    return res;
+}
+
+/*
+ * Description: Flush written blocks of disk to storage
+ * Params: Disk (file descriptor)
+ * Return: 0 for sucess or -1 indicating error
+ */
+int syncDisk(int disk) {
+    if (fsync(disk) == -1) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * Description: Hold writes to the first nBlocks blocks of disk in
+ *              memory instead of writing them. Reads see the held
+ *              blocks. Only one disk can be held at a time. Holding
+ *              and releasing must not overlap other calls on disk.
+ *              A disk cached with cacheDisk() stops writing back.
+ * Params: Disk (file descriptor), nBlocks
+ * Return: 0 for sucess or -1 indicating error
+ */
+int holdDisk(int disk, int nBlocks) {
+    if (hDisk != disk && newHeld(disk, nBlocks) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&hLock);
+    hPinned = 1;
+    pthread_mutex_unlock(&hLock);
+    return 0;
+}
+
+/*
+ * Description: Write blocks held for disk in block order, one write
+ *              per run of consecutive held blocks, and stop holding.
+ *              Blocks that fail to write stay held. A cached disk
+ *              goes back to writing back in the background.
+ * Params: Disk (file descriptor)
+ * Return: 0 for sucess or -1 indicating error
+ */
+int releaseDisk(int disk) {
+    if (disk != hDisk) {
+        return -1;
+    }
+    pthread_mutex_lock(&hLock);
+    hPinned = 0;
+    pthread_mutex_unlock(&hLock);
+    if (writeHeld(0) < 0) {
+        pthread_mutex_lock(&hLock);
+        hPinned = 1;
+        pthread_mutex_unlock(&hLock);
+        return -1;
+    }
+    if (!hCached) {
+        freeHeld();
+    }
+    return 0;
+}
+
+/*
+ * Description: Cache writes to the first nBlocks blocks of disk.
+ *              Writes only copy the block into memory, a flusher
+ *              thread writes blocks back once they have been dirty
+ *              for ageMs, or all of them once dirtyPct percent of
+ *              the blocks are dirty, coalescing consecutive blocks
+ *              into one write. Reads see the cached blocks.
+ * Params: Disk (file descriptor), nBlocks, ageMs, dirtyPct
+ * Return: 0 for sucess or -1 indicating error
+ */
+int cacheDisk(int disk, int nBlocks, int ageMs, int dirtyPct) {
+    if (hCached || ageMs <= 0 || dirtyPct <= 0) {
+        return -1;
+    }
+    if (hDisk != disk && newHeld(disk, nBlocks) < 0) {
+        return -1;
+    }
+    hAgeMs = ageMs;
+    hDirtyPct = dirtyPct;
+    hStop = 0;
+    hFailed = 0;
+    if (pthread_create(&hFlusher, NULL, flushLoop, NULL) != 0) {
+        if (!hPinned) {
+            freeHeld();
+        }
+        return -1;
+    }
+    hCached = 1;
+    return 0;
+}
+
+/*
+ * Description: Write every dirty cached block of disk back now,
+ *              unless writes are held by holdDisk(). A failed
+ *              write-back of the flusher since the last call is
+ *              reported as an error too.
+ * Params: Disk (file descriptor)
+ * Return: 0 for sucess or -1 indicating error
+ */
+int flushDisk(int disk) {
+    if (disk != hDisk) {
+        return 0;
+    }
+    int res = writeHeld(0);
+    return takeFailed() < 0 ? -1 : res;
+}
+
+/*
+ * Description: Stop caching disk, writing every dirty block back
+ *              first. Blocks held by holdDisk() stay held.
+ * Params: Disk (file descriptor)
+ * Return: 0 for sucess or -1 indicating error
+ */
+int uncacheDisk(int disk) {
+    if (disk != hDisk || !hCached) {
+        return 0;
+    }
+    stopFlusher();
+    if (writeHeld(0) < 0 || takeFailed() < 0) {
+        return -1;
+    }
+    if (!hPinned) {
+        freeHeld();
+    }
+    return 0;
+}
+
+/*
+ * Sets up the tables to hold nBlocks blocks of disk
+ */
+static int newHeld(int disk, int nBlocks) {
+    int n = nBlocks > 0 ? nBlocks : 1;
+
+    if (hDisk != -1 || fcntl(disk, F_GETFD) == -1 || nBlocks < 0) {
+        return -1;
+    }
+    hBlocks = calloc(n, sizeof(char *));
+    hVers = calloc(n, sizeof(unsigned));
+    hDirtyAt = calloc(n, sizeof(long));
+    if (hBlocks == NULL || hVers == NULL || hDirtyAt == NULL) {
+        free(hBlocks);
+        free(hVers);
+        free(hDirtyAt);
+        hBlocks = NULL;
+        return -1;
+    }
+    hDirty = 0;
+    hDisk = disk;
+    hNum = nBlocks;
+    return 0;
+}
+
+/*
+ * Drops the held blocks and their tables
+ */
+static void freeHeld() {
+    for (int i = 0; i < hNum; i++) {
+        free(hBlocks[i]);
+    }
+    free(hBlocks);
+    free(hVers);
+    free(hDirtyAt);
+    hBlocks = NULL;
+    hVers = NULL;
+    hDirtyAt = NULL;
+    hDirty = 0;
+    hPinned = 0;
+    hDisk = -1;
+}
+
+/*
+ * Returns -1 and forgets the failure if a write-back of the flusher
+ * failed since the last call, 0 otherwise
+ */
+static int takeFailed() {
+    int failed;
+
+    pthread_mutex_lock(&hLock);
+    failed = hFailed;
+    hFailed = 0;
+    pthread_mutex_unlock(&hLock);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Stops the flusher thread if one is running
+ */
+static void stopFlusher() {
+    if (!hCached) {
+        return;
+    }
+    pthread_mutex_lock(&hLock);
+    hStop = 1;
+    pthread_cond_signal(&hWake);
+    pthread_mutex_unlock(&hLock);
+    pthread_join(hFlusher, NULL);
+    hCached = 0;
+}
+
+/*
+ * Writes held blocks back in block order, one pwritev per run of
+ * consecutive blocks. With minAgeMs > 0 only blocks dirty at least
+ * that long start a run. Runs are copied out under hLock and written
+ * without it, so writers are never held up by the disk. A block
+ * written again meanwhile stays held. Returns 0 or -1
+ */
+static int writeHeld(int minAgeMs) {
+    int res = 0;
+    struct iovec iov[IOV_MAX];
+    unsigned vers[IOV_MAX];
+    char *run;
+
+    int max = hNum > 0 && hNum < IOV_MAX ? hNum : IOV_MAX;
+
+    pthread_mutex_lock(&hFlushLock);
+    if ((run = malloc((size_t)max * BLOCKSIZE)) == NULL) {
+        pthread_mutex_unlock(&hFlushLock);
+        return -1;
+    }
+    long now = nowMs();
+    for (int i = 0; i < hNum; i++) {
+        int n = 0;
+
+        /* Copy out the run starting at i */
+        pthread_mutex_lock(&hLock);
+        if (hPinned) {
+            pthread_mutex_unlock(&hLock);
+            break;
+        }
+        if (hBlocks[i] != NULL &&
+            (minAgeMs <= 0 || now - hDirtyAt[i] >= minAgeMs)) {
+            while (i + n < hNum && n < max && hBlocks[i + n] != NULL) {
+                memcpy(run + (size_t)n * BLOCKSIZE, hBlocks[i + n],
+                       BLOCKSIZE);
+                vers[n] = hVers[i + n];
+                iov[n].iov_base = run + (size_t)n * BLOCKSIZE;
+                iov[n].iov_len = BLOCKSIZE;
+                n++;
+            }
+        }
+        pthread_mutex_unlock(&hLock);
+        if (n == 0) {
+            continue;
+        }
+
+        /* Write it and let go of blocks not written again since */
+        if (pwritev(hDisk, iov, n, (off_t)i * BLOCKSIZE) !=
+            (ssize_t)n * BLOCKSIZE) {
+            res = -1;
+        } else {
+            pthread_mutex_lock(&hLock);
+            for (int j = 0; j < n; j++) {
+                if (hVers[i + j] == vers[j]) {
+                    free(hBlocks[i + j]);
+                    hBlocks[i + j] = NULL;
+                    hDirty--;
+                }
+            }
+            hDropped++;  // readers that saw the old disk read again
+            pthread_mutex_unlock(&hLock);
+        }
+        i += n - 1;
+    }
+    free(run);
+    pthread_mutex_unlock(&hFlushLock);
+    return res;
+}
+
+/*
+ * Flusher thread of a cached disk. Wakes every half age to write
+ * back aged blocks, or when writers pass the dirty share. After a
+ * failed write-back it waits the half age out before trying again,
+ * the blocks stay held and the failure is reported by flushDisk()
+ */
+static void *flushLoop(void *unused) {
+    struct timespec until;
+    int failed = 0;
+
+    pthread_mutex_lock(&hLock);
+    while (!hStop) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += hAgeMs / 2000;
+        until.tv_nsec += (hAgeMs / 2 % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (failed) {
+            // writers keep waking us past the dirty share, back off
+            while (!hStop && pthread_cond_timedwait(&hWake, &hLock,
+                                                    &until) != ETIMEDOUT) {
+            }
+        } else if (hPinned || hDirty * 100 < hDirtyPct * hNum) {
+            pthread_cond_timedwait(&hWake, &hLock, &until);
+        }
+        if (hStop) {
+            break;
+        }
+        int all = hDirty * 100 >= hDirtyPct * hNum;
+        pthread_mutex_unlock(&hLock);
+        failed = writeHeld(all ? 0 : hAgeMs) < 0;
+        pthread_mutex_lock(&hLock);
+        hFailed |= failed;
+    }
+    pthread_mutex_unlock(&hLock);
+    return NULL;
+}
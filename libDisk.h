@@ -1,15 +1,42 @@
 #ifndef LIBDISK_H
 #define LIBDISK_H
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "tinyFS.h"
 
+// Blocks moved by one thread since it started, see diskCounters()
+typedef struct DiskCounters {
+    uint64_t blocksRead;     // blocks read by the thread
+    uint64_t blocksWritten;  // blocks written, held or not
+    uint64_t cacheHits;      // blocks read that were held in memory
+    uint64_t cacheMisses;    // blocks read that came from the disk
+} DiskCounters;
+
 int openDisk(char *filename, int nBytes);
 int closeDisk(int disk);
 int readBlock(int disk, int bNum, void *block);
+int readBlocks(int disk, int bNum, int nBlocks, void *block);
+int readBlocksv(int disk, int bNum, struct iovec *iov, int iovcnt);
 int writeBlock(int disk, int bNum, void *block);
+int writeBlocks(int disk, int bNum, int nBlocks, void *block);
+int writeBlocksv(int disk, int bNum, struct iovec *iov, int iovcnt);
+int syncDisk(int disk);
+int holdDisk(int disk, int nBlocks);
+int releaseDisk(int disk);
+int cacheDisk(int disk, int nBlocks, int ageMs, int dirtyPct);
+int flushDisk(int disk);
+int uncacheDisk(int disk);
+void diskCounters(DiskCounters *counters);
 
 #endif /* LIBDISK_H */
\ No newline at end of file
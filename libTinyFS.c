@@ -2,552 +2,378 @@
 
 // Global Variables
 char *mDisk = NULL;         // mounted disk
-FileEntry *headOFT = NULL;  // head of OFT containing file entries
+int mDiskFd = -1;           // fd of mounted disk, open until unmount
+SuperBlock mSBlock;         // in-memory copy of mounted super block
+int mOpts = 0;              // mount options of mounted disk
+char *mImage = NULL;        // read only mapping of mounted disk, if any
+size_t mImageLen = 0;       // length of mImage
+int mBatch = 0;             // block writes are held until commitBatch()
+FileEntry mOFT[MAX_OPEN];   // OFT, an fd names its slot and generation
+AsyncReq mReqs[MAX_REQS];   // async requests, a handle names slot and gen
+int mReqHead = -1;          // next queued request for the workers
+int mReqTail = -1;          // last queued request
+int mAsyncOn = 0;           // workers are running
+int mDonePipe[2] = {-1, -1};        // handles of finished requests
+pthread_t mWorkers[ASYNC_WORKERS];  // worker pool
+pthread_mutex_t mReqLock = PTHREAD_MUTEX_INITIALIZER;  // guards mReqs
+pthread_cond_t mReqCond = PTHREAD_COND_INITIALIZER;    // request queued
+pthread_cond_t mDoneCond = PTHREAD_COND_INITIALIZER;   // request finished
+pthread_rwlock_t mFileLocks[FILE_LOCKS];  // file locks, see lockFS()
+pthread_mutex_t mAllocLock;                // super block and disk map
+pthread_mutex_t mOftLock;                  // slots of mOFT
+unsigned mFileSeq[FILE_LOCKS];  // odd while a file lock is held to write
+FileInfo mIndex[DMAP_SIZE];      // inode at each block the disk map marks 'I'
+unsigned mSeq = 0;               // seqlock over mSBlock and mIndex
+int mFreeRuns[DMAP_SIZE + 1];    // runs of free blocks in mSBlock by length
+int mNumFree = 0;                // free blocks in mSBlock
+int mNumFiles = 0;               // inodes in mSBlock
+pthread_mutex_t mSeqLock = PTHREAD_MUTEX_INITIALIZER;  // mSeq writers
+pthread_once_t mLockOnce = PTHREAD_ONCE_INIT;
+int mDefragOn = 0;      // background defragmenter is running
+int mDefragBudget = 0;  // blocks it may move per second
+pthread_t mDefragger;   // background defragmenter
+pthread_mutex_t mDefragLock = PTHREAD_MUTEX_INITIALIZER;  // guards mDefragOn
+pthread_cond_t mDefragCond = PTHREAD_COND_INITIALIZER;    // stop requested
+int mLogLevel = TFS_LOG_OFF;  // messages above this level are skipped
+int mTraceOn = 0;             // calls are recorded in mTrace
+TraceRec mTrace[TRACE_SIZE];  // ring of the last TRACE_SIZE calls
+uint32_t mTraceNext = 0;      // number of the next trace record
+OpStats mStats[STAT_SHARDS][NUM_OPS];  // per operation, see tfs_getStats()
+int mNextShard = 0;                    // shard of the next new thread
+__thread int mShard = -1;              // shard of this thread, -1 if none
+int mRecordOn = 0;         // calls are recorded to mRecord
+FILE *mRecord = NULL;      // recording, see tfs_startRecord()
+int64_t mRecordLast = 0;   // start of the latest recorded call
+pthread_mutex_t mRecordLock = PTHREAD_MUTEX_INITIALIZER;  // guards mRecord
 
 /*
- * Opens a new disk and initializes it with a super block
- * and free block to store future files
+ * Opens a new disk and initializes it with a super block.
+ * Free blocks are not written, they stay holes in the sparse
+ * image until they are allocated
  */
 int tfs_mkfs(char *filename, int nBytes) {
     int diskFd;
     int numBlocks = nBytes / BLOCKSIZE;
 
+    /* Disk map in super block limits how many blocks can be tracked */
+    if (numBlocks > DMAP_SIZE) {
+        numBlocks = DMAP_SIZE;
+        nBytes = numBlocks * BLOCKSIZE;
+    }
+
     if ((diskFd = openDisk(filename, nBytes)) < 0) {
-        printf("> Failed to open disk. Exited mkfs() with status: %d\n",
+        tfsErr("> Failed to open disk. Exited mkfs() with status: %d\n",
                OPEN_DISK_ERR);
         return OPEN_DISK_ERR;
     }
 
-    // init empty buf (0x00)
-    char *emptyBuf = calloc(BLOCKSIZE, sizeof(char));
-
-    // populate disk w/ empty buf
-    for (int i = 0; i < numBlocks; i++) {
-        if ((writeBlock(diskFd, i, emptyBuf)) < 0) {
-            printf(
-                "> Failed to write block. Exited mkfs() with status: "
-                "%d\n",
-                WRITE_BLOCK_ERR);
-            return WRITE_BLOCK_ERR;
-        }
-    }
-
-    // free empty buf after writing to disk
-    free(emptyBuf);
-
-    // setup file system with super block and free blocks
+    // setup file system with super block
     if ((setupFS(diskFd, numBlocks)) < 0) {
-        printf("> Failed to write block. Exited mkfs() with status: %d\n",
+        tfsErr("> Failed to write block. Exited mkfs() with status: %d\n",
                WRITE_BLOCK_ERR);
+        closeDisk(diskFd);
         return WRITE_BLOCK_ERR;
     }
 
+    closeDisk(diskFd);
+
     // log success
-    printf("] Created new disk '%s'\n", filename);
+    tfsLog("] Created new disk '%s'\n", filename);
     return 0;
 }
 
 /*
- * Set current disk being accessed to new disk
+ * Set current disk being accessed to new disk with default
+ * mount options
  */
-int tfs_mount(char *diskname) {
+int tfs_mount(char *diskname) { return tfs_mountOpts(diskname, 0); }
+
+/*
+ * Set current disk being accessed to new disk. A disk that was
+ * cleanly unmounted is trusted as is, otherwise the disk map and
+ * free count are rebuilt from the blocks on disk. Options pick how
+ * access times are updated (TFS_NOATIME, TFS_RELATIME, TFS_LAZYTIME)
+ * and whether writes are cached (TFS_WRITEBACK)
+ */
+int mountOptsLocked(char *diskname, int opts) {
     int diskFd;
-    char sbBuf[BLOCKSIZE];
+    SuperBlock sBlock;
 
     /* Unmount current disk if another disk is mounted */
     if (mDisk != NULL) {
-        tfs_unmount();
+        unmountLocked();
     }
 
     /* Mount to new disk by opening the disk */
     if ((diskFd = openDisk(diskname, 0)) < 0) {
-        printf("> Failed to open disk. Exited mount() with status: %d\n",
+        tfsErr("> Failed to open disk. Exited mount() with status: %d\n",
                OPEN_DISK_ERR);
         return OPEN_DISK_ERR;
     }
 
     /* Read super block metadata to confirms magic number */
-    if ((readBlock(diskFd, 0, sbBuf)) < 0) {
-        printf("> Failed to read block. Exited mount() with status: %d\n",
+    if ((readBlock(diskFd, 0, &sBlock)) < 0) {
+        tfsErr("> Failed to read block. Exited mount() with status: %d\n",
                READ_BLOCK_ERR);
+        closeDisk(diskFd);
         return READ_BLOCK_ERR;
     }
 
     /* Validate magic number */
-    if (sbBuf[1] != 0x44) {
-        printf(
+    if (sBlock.mNum != 0x44) {
+        tfsErr(
             "> Failed to verify magic number. Exited mount() with status: %d\n",
             INVALID_MNUM_ERR);
+        closeDisk(diskFd);
         return INVALID_MNUM_ERR;
     }
 
+    /* Rebuild metadata if disk was not cleanly unmounted */
+    if (sBlock.state != SB_CLEAN) {
+        if (rebuildFS(diskFd, &sBlock) < 0) {
+            tfsErr(
+                "> Failed to read block. Exited mount() with status: %d\n",
+                READ_BLOCK_ERR);
+            closeDisk(diskFd);
+            return READ_BLOCK_ERR;
+        }
+    }
+
+    /* Mark disk dirty until it is unmounted */
+    sBlock.state = SB_DIRTY;
+    if (writeBlock(diskFd, 0, &sBlock) < 0) {
+        tfsErr("> Failed to write block. Exited mount() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        closeDisk(diskFd);
+        return WRITE_BLOCK_ERR;
+    }
+
     /* Set mounted disk to new disk */
     mDisk = calloc(sizeof(char), strlen(diskname) + 1);
     strcpy(mDisk, diskname);
+    mDiskFd = diskFd;
+    mOpts = opts;
+    seqWriteBegin();
+    seqStore(&mSBlock, &sBlock, sizeof(SuperBlock));
+    countSpace();
+    seqWriteEnd();
+    if (buildIndex(diskFd) < 0) {
+        tfsErr("> Failed to read block. Exited mount() with status: %d\n",
+               READ_BLOCK_ERR);
+        unmountLocked();
+        return READ_BLOCK_ERR;
+    }
+
+    // writes from here on only copy blocks, a flusher writes them back
+    if ((opts & TFS_WRITEBACK) &&
+        cacheDisk(diskFd, sBlock.numBlocks, WB_AGE_MS, WB_DIRTY_PCT) < 0) {
+        tfsErr("> Failed to cache disk. Exited mount() with status: %d\n",
+               OPEN_DISK_ERR);
+        unmountLocked();
+        return OPEN_DISK_ERR;
+    }
 
     // log success
-    printf("] Mounted to disk '%s'\n", mDisk);
+    tfsLog("] Mounted to disk '%s'\n", mDisk);
     return 0;
 }
 
 /*
- * Remove current disk being accessed
+ * Remove current disk being accessed. Flushes the disk and
+ * marks the super block clean so the next mount can trust it
  */
-int tfs_unmount() {
+int unmountLocked() {
     if (mDisk == NULL) {
-        printf("] Nothing to unmount");
+        tfsLog("] Nothing to unmount\n");
+        return 0;
+    }
+
+    /* Commit an open batch */
+    if (mBatch && commitBatchLocked() < 0) {
+        tfsErr("> Failed to write block. Exited unmount() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    /* Flush access times and file blocks before recording a clean unmount,
+       uncommitted streams are dropped */
+    for (FileEntry *curr = nextEntry(NULL); curr != NULL;
+         curr = nextEntry(curr)) {
+        if (dropStream(mDiskFd, curr) < 0 ||
+            flushATime(mDiskFd, curr->filename) < 0) {
+            tfsErr(
+                "> Failed to write block. Exited unmount() with status: %d\n",
+                WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+    }
+    if (uncacheDisk(mDiskFd) < 0 || syncDisk(mDiskFd) < 0) {
+        tfsErr("> Failed to write block. Exited unmount() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    seqWriteBegin();
+    __atomic_store_n(&mSBlock.state, SB_CLEAN, __ATOMIC_RELEASE);
+    seqWriteEnd();
+    if (writeSuperBlock(mDiskFd, &mSBlock) < 0 || syncDisk(mDiskFd) < 0) {
+        tfsErr("> Failed to write block. Exited unmount() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    // pointers from mapFile() end with the mount
+    if (mImage != NULL) {
+        munmap(mImage, mImageLen);
+        mImage = NULL;
     }
-    printf("] Unmounted to '%s'\n", mDisk);
+
+    closeDisk(mDiskFd);
+    tfsLog("] Unmounted to '%s'\n", mDisk);
     free(mDisk);
+    mDisk = NULL;
+    mDiskFd = -1;
     return 0;
 }
 
 /*
- * Opens or creates a new file. Updates OFT in
- * the process of creating a file
+ * Opens or creates a new file. Every open takes its own
+ * slot in the OFT so each fd has its own file pointer
  */
-fileDescriptor tfs_openFile(char *name) {
+fileDescriptor openFileLocked(char *name) {
     fileDescriptor fd;
     time_t initTime;
-    FileEntry *newFE = malloc(sizeof(FileEntry));  // debug remember to free
-    FileEntry *curr1 = headOFT;
-    FileEntry *curr2 = headOFT;
+    FileEntry *newFE = NULL;
 
     /* Check if disk is mounted and open mounted disk */
     if (mDisk == NULL) {
-        printf("> Failed to open disk. Exited openFile() with status: %d\n",
+        tfsErr("> Failed to open disk. Exited openFile() with status: %d\n",
                NO_DISK_MOUNTED_ERR);
         return NO_DISK_MOUNTED_ERR;
     }
 
-    /* Check if file exist in OFT LL -> if true, return fd */
-    // if file is found in OFT, it is assumed that it has been opened
-    while (curr1 != NULL) {
-        if (strcmp(curr1->filename, name) == 0) {
-            printf("] Opened file '%s' with fd: %d\n", name, curr1->fd);
-            return curr1->fd;
-        }
-        curr1 = curr1->next;
-    }
-
-    /* Creating new file */
+    /* Creating new file entry, every open gets its own fp */
     // validate filename is within 8 characters
     if (strlen(name) > sizeof(newFE->filename) - 1) {
-        printf(
+        tfsErr(
             "> Filename must be within 8 alphanumeric characters. "
             "Exited openFile() with status %d\n",
             FILENAME_ERR);
         return FILENAME_ERR;
     }
 
-    // open a new file for r/w operations
-    if ((fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
-        printf("> Failed to open file. Exited openFile() with status: %d\n",
+    // take a free slot, fd carries the slot's generation so a closed
+    // fd never matches a later open of the same slot
+    for (int i = 0; i < MAX_OPEN && newFE == NULL; i++) {
+        if (!mOFT[i].inUse) {
+            newFE = &mOFT[i];
+            newFE->gen = newFE->gen % (INT_MAX / MAX_OPEN - 1) + 1;
+            fd = newFE->gen * MAX_OPEN + i;
+        }
+    }
+    if (newFE == NULL) {
+        tfsErr("> Too many open files. Exited openFile() with status: %d\n",
                OPEN_FILE_ERR);
         return OPEN_FILE_ERR;
     }
 
     // create file entry
-    newFE->fd = fd;
-    strcpy(newFE->filename, name);
-    newFE->filename[8] = '\0';
-    newFE->next = NULL;
+    setEntry(newFE, fd, name, 1);
+    newFE->inIdx = -1;
+    newFE->fp = 0;
+    newFE->pendATime = 0;
+    newFE->strmIdx = -1;
+    newFE->strmLen = 0;
+    newFE->strmRoom = 0;
+    newFE->strmBlk = NULL;
     time(&initTime);
     newFE->initTime = initTime;
 
-    // add new file entry to OFT
-    if (headOFT == NULL) {
-        headOFT = newFE;
-    } else {
-        while (curr2->next != NULL) {
-            curr2 = curr2->next;
-        }
-        curr2->next = newFE;
-    }
-
     // log success
-    printf("] Opened file '%s' with fd: %d\n", name, fd);
+    tfsLog("] Opened file '%s' with fd: %d\n", name, fd);
     return fd;
 }
 
 /*
  * Cloes file. Removes file entry from OFT
  */
-int tfs_closeFile(fileDescriptor fd) {
+int closeFileLocked(fileDescriptor fd) {
     char rmvFile[9];
-    FileEntry *rmvFE = NULL;
-    FileEntry *curr1 = headOFT;
+    FileEntry *rmvFE;
 
     /* Check if disk is mounted and open mounted disk */
     if (mDisk == NULL) {
-        printf(
+        tfsErr(
             "> Failed to open disk. Exited closeFile() with status: "
             "%d\n",
             NO_DISK_MOUNTED_ERR);
         return NO_DISK_MOUNTED_ERR;
     }
 
-    /* Search and remove file entry from OFT */
-    int foundFd = -1;
-    if (curr1 != NULL) {
-        // first check head of OFT
-        if (curr1->fd == fd) {
-            foundFd = 0;
-            rmvFE = headOFT;
-            headOFT = curr1->next;
-
-            memcpy(rmvFile, rmvFE->filename, strlen(rmvFE->filename));
-            free(rmvFE);
-        } else {
-            while (curr1->next != NULL) {
-                if (curr1->next->fd == fd) {
-                    // the next file entry is be removed
-                    foundFd = 0;
-                    rmvFE = curr1->next;
-                    curr1->next = curr1->next->next;
-
-                    memcpy(rmvFile, rmvFE->filename, strlen(rmvFE->filename));
-                    free(rmvFE);
-                } else {
-                    curr1 = curr1->next;
-                }
-            }
-        }
-
-        // fd not found -> return > Error
-        if (foundFd < 0) {
-            printf(
-                "> File not in OFT. Exited closeFile() with status: "
-                "%d\n",
-                CLOSE_FILE_ERR);
-            return CLOSE_FILE_ERR;
-        }
-    } else {
-        // nothing in OFT -> no file to close
-        printf("> File not in OFT. Exited closeFile() with status: %d\n",
+    /* Find file entry, fd not found -> return > Error */
+    if ((rmvFE = getEntry(fd)) == NULL) {
+        tfsErr("> File not in OFT. Exited closeFile() with status: %d\n",
                CLOSE_FILE_ERR);
         return CLOSE_FILE_ERR;
     }
 
-    printf("] Closed file '%s'\n", rmvFile);
+    /* Write out access time held back by lazytime, an uncommitted
+       stream is dropped */
+    flushATime(mDiskFd, rmvFE->filename);
+    dropStream(mDiskFd, rmvFE);
+
+    /* Free slot of OFT */
+    strcpy(rmvFile, rmvFE->filename);
+    pthread_mutex_lock(&mOftLock);
+    setEntry(rmvFE, rmvFE->fd, NULL, 0);
+    pthread_mutex_unlock(&mOftLock);
+
+    tfsLog("] Closed file '%s'\n", rmvFile);
     return 0;
 }
 
 /*
  * Write to file and update disk
  */
+int writeFileLocked(fileDescriptor fd, char *buffer, int size) {
+    struct iovec iov;
 
-int tfs_writeFile(fileDescriptor fd, char *buffer, int size) {
-    int diskFd;
-    int ibIndex;
-    int fcbLen;
-    char filename[9];
-    int rdOnlyFlg = -1;
-    time_t initTime;
-    time_t newTime;
-    SuperBlock sBlock;
-    InodeBlock iBlock;
-
-    /* Check if disk is mounted and open it */
-    if (mDisk == NULL) {
-        return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited writeFile() with "
-                "status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
-    }
-
-    /* Confirm fd is in OFT and get associated filename */
-    int foundFd = -1;
-    FileEntry *curr = headOFT;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename and init time
-            initTime = curr->initTime;
-        }
-        curr = curr->next;
-    }
-
-    if (foundFd < 0) {
-        printf(
-            "> File not in OFT. Exited writeFile() with status: "
-            "%d\n",
-            WRITE_FILE_ERR);
-        return WRITE_FILE_ERR;
-    }
-
-    /* Get write size in terms of blocks */
-    fcbLen = (int)ceil((double)size / (BLOCKSIZE - 2));
-
-    /* Get metadata from super block */
-    if ((readBlock(diskFd, 0, &sBlock)) < 0) {
-        printf(
-            "> Failed to read block. Exited writeFile() with status: "
-            "%d\n ",
-            READ_BLOCK_ERR);
-        return READ_BLOCK_ERR;
-    }
-
-    /* Check if inode exists */
-    int foundIn = -1;
-    InodeBlock tmpIn;
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if ((readBlock(diskFd, i, &tmpIn)) < 0) {
-                printf(
-                    "> Failed to read block. Exited writeFile() with "
-                    "status: %d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (strcmp(tmpIn.filename, filename) == 0) {
-                foundIn = 0;
-                rdOnlyFlg = tmpIn.rdOnly;
-                break;
-            }
-        }
-    }
-
-    /* If read only flag is set -> return with error */
-    if (rdOnlyFlg == 0) {
-        printf(
-            "> File '%s' is READ only. Exited writeFile() with status: "
-            "%d\n",
-            filename, READ_ONLY_ERR);
-        return READ_ONLY_ERR;
-    }
-
-    /* If inode exist -> store inode and fcb as backup */
-    char backup[BLOCKSIZE * (tmpIn.fcbLen + 1)];
-    if (foundIn == 0) {
-        int rdIdx = tmpIn.posInDsk;
-        char buf[BLOCKSIZE];
-        size_t offset = 0;
-
-        for (int i = 0; i < tmpIn.fcbLen + 1; i++) {
-            if ((readBlock(diskFd, rdIdx, &buf)) < 0) {
-                printf(
-                    "> Failed to read block. Exited writeFile() with "
-                    "status: "
-                    "%d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            memcpy(backup + offset, buf, BLOCKSIZE);
-            offset += BLOCKSIZE;
-            rdIdx += 1;
-        }
-
-        /* Remove inode and associate fcbs */
-        if (removeInAndFcb(diskFd, filename) < 0) {
-            printf(
-                "> Failed to write to file. Exited writeFile() with "
-                "status: "
-                "%d\n",
-                WRITE_FILE_ERR);
-            return WRITE_FILE_ERR;
-        };
-    }
-
-    /* Get metadata from super block after deletion */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
-            "> Failed to read block. Exited writeFile() with status: "
-            "%d\n ",
-            READ_BLOCK_ERR);
-        return READ_BLOCK_ERR;
-    }
-
-    /* Get start update index of where to write in super block after deletion */
-    if ((ibIndex = getStartBlock(fcbLen, sBlock.dMap, sBlock.numBlocks)) < 0) {
-        if (foundIn == 0) {
-            // if no space -> write the backup buf back to disk and update dMap
-            int wrIdx = tmpIn.posInDsk;
-            char buf[BLOCKSIZE];
-            size_t offset = 0;
-            for (int i = 0; i < tmpIn.fcbLen + 1; i++) {
-                memcpy(buf, backup + offset, BLOCKSIZE);
-
-                // update disk
-                if (writeBlock(diskFd, wrIdx, &buf) < 0) {
-                    printf(
-                        "> Failed to write block. Exited writeFile() "
-                        "with status: "
-                        "%d\n",
-                        WRITE_BLOCK_ERR);
-                    return WRITE_BLOCK_ERR;
-                }
-
-                // update dMap in super block
-                if (i == 0) {
-                    sBlock.dMap[wrIdx] = 'I';
-                } else {
-                    sBlock.dMap[wrIdx] = 'C';
-                }
-
-                offset += BLOCKSIZE;
-                wrIdx += 1;
-            }
-
-            // update disk with restored dMap in super block
-            if (writeBlock(diskFd, 0, &sBlock) < 0) {
-                printf(
-                    "> Failed to write block. Exited writeFile() with "
-                    "status: %d\n",
-                    WRITE_BLOCK_ERR);
-                return WRITE_BLOCK_ERR;
-            }
-        }
-        printf(
-            "> No space to write. Exited writeFile() with status: "
-            "%d\n",
-            NO_SPACE_ERR);
-        return NO_SPACE_ERR;
-    }
-
-    /* Get metadata from super block after deletion */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
-            "> Failed to read block. Exited writeFile() with status: "
-            "%d\n ",
-            READ_BLOCK_ERR);
-        return READ_BLOCK_ERR;
-    }
-
-    /* Create inode for fd and write block */
-    iBlock.type = 2;
-    iBlock.mNum = 0x44;
-    strcpy(iBlock.filename, filename);
-    iBlock.fSize = size;
-    iBlock.fcbLen = fcbLen;
-    iBlock.fp = 0;
-    iBlock.posInDsk = ibIndex;
-    iBlock.rdOnly = -1;
-
-    if (foundIn == -1) {
-        iBlock.createTime = initTime;
-        iBlock.modTime = initTime;
-        iBlock.accessTime = initTime;
-    } else {
-        iBlock.createTime = initTime;
-        time(&newTime);
-        iBlock.modTime = newTime;
-        iBlock.accessTime = newTime;
-    }
-
-    memset(iBlock.data, 0, sizeof(iBlock.data));
-
-    /* Update disk map with new inode */
-    sBlock.dMap[ibIndex] = 'I';
-
-    /* Write inode block into disk */
-    if (writeBlock(diskFd, ibIndex, &iBlock) < 0) {
-        printf(
-            "> Failed to write block. Exited writeFile() with status: "
-            "%d\n",
-            WRITE_BLOCK_ERR);
-        return WRITE_BLOCK_ERR;
-    }
-
-    /* Write file context blocks to disk */
-    int fcbIndex = ibIndex + 1;
-    size_t offset = 0;
-
-    while (offset < size) {
-        FileContextBlock fcBlock;
-        fcBlock.type = 3;
-        fcBlock.mNum = 0x44;
-
-        memset(fcBlock.context, 0, sizeof(fcBlock.context));
-        size_t ctxSize;
-        if (size - offset > sizeof(fcBlock.context)) {
-            ctxSize = sizeof(fcBlock.context);
-        } else {
-            ctxSize = size - offset;
-        }
-        memcpy(fcBlock.context, buffer + offset, ctxSize);
-
-        // write the fcbBlock to disk
-        if (writeBlock(diskFd, fcbIndex, &fcBlock) < 0) {
-            printf(
-                "> Failed to write block. Exited writeFile() with "
-                "status: %d\n",
-                WRITE_BLOCK_ERR);
-        }
-
-        // update disk map with file context blocks
-        sBlock.dMap[fcbIndex] = 'C';
-
-        // move to the next block
-        fcbIndex++;
-        offset += sizeof(fcBlock.context);
-    }
-
-    /* Update super block w/inode */
-    if (writeBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
-            "> Failed to write block. Exited writeFile() with status: "
-            "%d\n",
-            WRITE_BLOCK_ERR);
-        return WRITE_BLOCK_ERR;
-    }
-
-    // log success
-    printf("] Wrote to '%s'\n", filename);
-
-    return 0;
+    iov.iov_base = buffer;
+    iov.iov_len = size < 0 ? 0 : size;
+    return writeFileV(fd, &iov, 1, "writeFile");
 }
 
 /*
  * Delete file (must be open) and update disk
  */
-int tfs_deleteFile(fileDescriptor fd) {
+int deleteFileLocked(fileDescriptor fd) {
     int diskFd;
     int rdOnlyFlg = -1;
     char filename[9];
-    FileEntry *curr = headOFT;
+    FileEntry *curr;
     SuperBlock sBlock;
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited deleteFile() with status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Confirm fd is in OFT, get assoicate filename, close the file */
     int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename
-            break;
-        }
-        curr = curr->next;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename
     }
     if (foundFd < 0) {
-        printf("> File not in OFT. Exited deleteFile() with status: %d\n",
+        tfsErr("> File not in OFT. Exited deleteFile() with status: %d\n",
                DELETE_FILE_ERR);
         return DELETE_FILE_ERR;
     }
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
             "> Failed to read block. Exited deleteFile() with status: "
             "%d\n ",
             READ_BLOCK_ERR);
@@ -559,7 +385,7 @@ int tfs_deleteFile(fileDescriptor fd) {
     for (int i = 0; i < sBlock.numBlocks; i++) {
         if (sBlock.dMap[i] == 'I') {
             if (readBlock(diskFd, i, &tmpIn) < 0) {
-                printf(
+                tfsErr(
                     "> Failed to read block. Exited deleteFile() with "
                     "status: %d\n",
                     READ_BLOCK_ERR);
@@ -574,145 +400,118 @@ int tfs_deleteFile(fileDescriptor fd) {
 
     /* If read only flag is set -> return with error */
     if (rdOnlyFlg == 0) {
-        printf(
+        tfsErr(
             "> File '%s' is READ only. Exited deleteFile() with status: "
             "%d\n",
             filename, READ_ONLY_ERR);
         return READ_ONLY_ERR;
     }
 
-    /* Close file in OFT */
-    tfs_closeFile(fd);
+    /* Access times held back by lazytime are dropped with the file */
+    pthread_mutex_lock(&mOftLock);
+    for (curr = nextEntry(NULL); curr != NULL; curr = nextEntry(curr)) {
+        if (strcmp(curr->filename, filename) == 0) {
+            curr->pendATime = 0;
+        }
+    }
+
+    /* Close file in OFT along with other fds open on it */
+    closeFileLocked(fd);
+    for (curr = nextEntry(NULL); curr != NULL; curr = nextEntry(curr)) {
+        if (strcmp(curr->filename, filename) == 0) {
+            closeFileLocked(curr->fd);
+        }
+    }
+    pthread_mutex_unlock(&mOftLock);
 
     /* Remove inode and associated FCBs */
     if (removeInAndFcb(diskFd, filename) < 0) {
-        printf(
+        tfsErr(
             "> Failed to remove blocks. Exited deleteFile() with status: %d\n",
             DELETE_FILE_ERR);
         return DELETE_FILE_ERR;
     }
 
-    /* Delete actual file */
-    if (remove(filename) < 0) {
-        printf("> Failed to delete file. Exited deleteFile() with status: %d\n",
-               DELETE_FILE_ERR);
-    }
     // log success
-    printf("] Deleted '%s'\n", filename);
+    tfsLog("] Deleted '%s'\n", filename);
     return 0;
 }
 
 /*
  * Reads one byte from file and coppies it into buffer.
  */
-int tfs_readByte(fileDescriptor fd, char *buffer) {
+int readByteLocked(fileDescriptor fd, char *buffer) {
     int diskFd;
     int fp;
     int fSize;
     int fcbIndex;
     int foundIn = -1;
     char filename[9];
-    time_t newTime;
-    FileEntry *curr = headOFT;
-    SuperBlock sBlock;
+    FileEntry *curr;
     InodeBlock iBlock;
     FileContextBlock tmpFCB;
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited readByte() with status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Confirm fd is in OFT and get assoicate filename */
     int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename
-        }
-        curr = curr->next;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename
     }
     if (foundFd < 0) {
-        printf("> File not in OFT. Exited readByte() with status: %d\n",
+        tfsErr("> File not in OFT. Exited readByte() with status: %d\n",
                READ_BYTE_ERR);
         return READ_BYTE_ERR;
     }
 
-    /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited readByte() with status: %d\n ",
+    /* Get inode to know file size and fp */
+    int inIdx = entryInode(diskFd, curr, &iBlock);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited readByte() with status: %d\n",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
-    }
-
-    /* Get inode to know file size and fp */
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if (readBlock(diskFd, i, &iBlock) < 0) {
-                printf(
-                    "> Failed to read block. Exited readByte() with status: "
-                    "%d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (strcmp(iBlock.filename, filename) == 0) {
-                foundIn = 0;
-                fp = iBlock.fp;
-                fSize = iBlock.fSize;
-                fcbIndex = iBlock.posInDsk + 1;
-                break;
-            }
-        }
+    } else if (inIdx >= 0) {
+        foundIn = 0;
+        fp = curr->fp;
+        fSize = iBlock.fSize;
+        fcbIndex = iBlock.posInDsk + 1;
     }
 
     /* Read byte */
     if (foundIn == 0) {
-        // copying fcb into temp buffer
-        int offset = 0;
-        char tmpBuf[iBlock.fcbLen * (BLOCKSIZE - 2)];  // 254 bytes
-        for (int i = 0; i < iBlock.fcbLen; i++) {
-            if (readBlock(diskFd, fcbIndex, &tmpFCB) < 0) {
-                printf(
+        // Check if fp did not exceed file size -> copy byte at fp to buffer
+        if (fp < fSize) {
+            // only the fcb holding fp is read
+            int room = FCB_ROOM(&iBlock);
+            if (readBlock(diskFd, fcbIndex + fp / room, &tmpFCB) < 0) {
+                tfsErr(
                     "> Failed to read block. Exited readByte() with status: "
                     "%d\n",
                     READ_BLOCK_ERR);
                 return READ_BLOCK_ERR;
             }
-            memcpy(tmpBuf + offset, tmpFCB.context, sizeof(tmpFCB.context));
-            fcbIndex++;
-            offset += sizeof(tmpFCB.context);
-        }
+            *buffer = ((char *)&tmpFCB)[FCB_HEAD(&iBlock) + fp % room];
+            curr->fp = fp + 1;
 
-        // Check if fp did not exceed file size -> copy byte at fp to buffer
-        if (fp < fSize) {
-            *buffer = tmpBuf[fp];
-            fp++;
-            // update fp in inode block in disk
-            iBlock.fp = fp;
-            time(&newTime);
-            iBlock.accessTime = newTime;
-            if (writeBlock(diskFd, iBlock.posInDsk, &iBlock) < 0) {
-                printf(
+            // update access time as mount options allow
+            if (touchATime(diskFd, curr, &iBlock) < 0) {
+                tfsErr(
                     "> Failed to write block. Exited readByte() with status: "
                     "%d\n",
                     WRITE_BLOCK_ERR);
                 return WRITE_BLOCK_ERR;
             }
         } else {
-            printf("\n> Exited readByte() with status: %d\n", READ_BYTE_ERR);
+            tfsErr("\n> Exited readByte() with status: %d\n", READ_BYTE_ERR);
             return READ_BYTE_ERR;
         }
     } else {
-        printf("> Exited readByte() with status: %d\n", READ_BYTE_ERR);
+        tfsErr("> Exited readByte() with status: %d\n", READ_BYTE_ERR);
         return READ_BYTE_ERR;
     }
 
@@ -720,88 +519,56 @@ int tfs_readByte(fileDescriptor fd, char *buffer) {
 }
 
 /*
- * Moves fp to desired offset
+ * Moves fp of this fd to desired offset
  */
-int tfs_seek(fileDescriptor fd, int offset) {
+int seekLocked(fileDescriptor fd, int offset) {
     int diskFd;
     int size;
     char filename[9];
-    FileEntry *curr = headOFT;
-    SuperBlock sBlock;
-    /* Check if disk is mounted and open it */
+    FileEntry *curr;
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited seek() status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Confirm fd is in OFT and get associated filename */
     int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename
-        }
-        curr = curr->next;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename
     }
     if (foundFd < 0) {
-        printf("> File not in OFT. Exited seek() status:  %d\n",
+        tfsErr("> File not in OFT. Exited seek() status:  %d\n",
                INVALID_SEEK_ERR);
         return INVALID_SEEK_ERR;
     }
 
-    /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited seek() status:  %d\n ",
-               READ_BLOCK_ERR);
-        return READ_BLOCK_ERR;
-    }
-
     /* Find inode to get size of file */
     int foundIn = -1;
     InodeBlock tmpIn;
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if (readBlock(diskFd, i, &tmpIn) < 0) {
-                printf(
-                    "> Failed to read block. Exited seek() status: "
-                    "%d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (strcmp(tmpIn.filename, filename) == 0) {
-                foundIn = 0;
-                size = tmpIn.fSize;
-                break;
-            }
-        }
+    int inIdx = entryInode(diskFd, curr, &tmpIn);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited seek() status: %d\n",
+               READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    } else if (inIdx >= 0) {
+        foundIn = 0;
+        size = tmpIn.fSize;
     }
 
     if (foundIn == 0) {
         /* Check if seek is valid */
         if (offset > size) {
-            printf("> Invalid seek. Exited seek() status: %d\n",
+            tfsErr("> Invalid seek. Exited seek() status: %d\n",
                    INVALID_SEEK_ERR);
             return INVALID_SEEK_ERR;
         }
 
-        tmpIn.fp = offset;
-
-        // Update fp in inode block in disk
-        if (writeBlock(diskFd, tmpIn.posInDsk, &tmpIn) < 0) {
-            printf("> Failed to write block. Exited seek() status: %d\n",
-                   WRITE_BLOCK_ERR);
-            return WRITE_BLOCK_ERR;
-        }
+        // fp only lives in the OFT entry
+        curr->fp = offset;
     }
-    printf("] Seeked '%s'\n", filename);
+    tfsLog("] Seeked '%s'\n", filename);
     return 0;
 }
 
@@ -810,56 +577,51 @@ int tfs_seek(fileDescriptor fd, int offset) {
 /*
  * Renames an open file
  */
-int tfs_rename(fileDescriptor fd, char *newName) {
+int renameLocked(fileDescriptor fd, char *newName) {
     int diskFd;
     char oldFilename[9];
-    FileEntry *curr = headOFT;
+    FileEntry *curr;
     SuperBlock sBlock;
     InodeBlock iBlock;
 
     /* Ensure new name is within 8 character */
     if (strlen(newName) > 8) {
-        printf(
+        tfsErr(
             "> Filename must be within 8 alphanumeric characters. "
             "Exited openFile() with status %d\n",
             FILENAME_ERR);
         return FILENAME_ERR;
     }
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf("> Failed to open disk. Exited rename() with status: %d\n",
-                   OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Confirm fd is in OFT and get associated filename */
     int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(
-                oldFilename,
-                curr->filename);  // copy old filename to use for inode search
-            strcpy(curr->filename, newName);  // updates filename in OFT
-            break;
-        }
-        curr = curr->next;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(oldFilename,
+               curr->filename);  // copy old filename to use for inode search
     }
     if (foundFd < 0) {
-        printf("> File not in OFT. Exited rename() with status: %d\n",
+        tfsErr("> File not in OFT. Exited rename() with status: %d\n",
                FILENAME_ERR);
         return FILENAME_ERR;
     }
 
+    /* Update filename in OFT for every fd open on the file */
+    for (curr = nextEntry(NULL); curr != NULL; curr = nextEntry(curr)) {
+        if (strcmp(curr->filename, oldFilename) == 0) {
+            setEntry(curr, curr->fd, newName, 1);
+        }
+    }
+
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited rename() with status: %d\n ",
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr("> Failed to read block. Exited rename() with status: %d\n ",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
     }
@@ -868,17 +630,18 @@ int tfs_rename(fileDescriptor fd, char *newName) {
     for (int i = 0; i < sBlock.numBlocks; i++) {
         if (sBlock.dMap[i] == 'I') {
             if (readBlock(diskFd, i, &iBlock) < 0) {
-                printf(
+                tfsErr(
                     "> Failed to read block. Exited rename() with status: "
                     "%d\n",
                     READ_BLOCK_ERR);
                 return READ_BLOCK_ERR;
             }
             if (strcmp(iBlock.filename, oldFilename) == 0) {
+                applyATime(newName, &iBlock);
                 strcpy(iBlock.filename, newName);
                 // Update filename in inode block in disk
-                if (writeBlock(diskFd, iBlock.posInDsk, &iBlock) < 0) {
-                    printf(
+                if (writeInode(diskFd, &iBlock) < 0) {
+                    tfsErr(
                         "> Failed to write block. Exited rename() with status: "
                         "%d\n",
                         WRITE_BLOCK_ERR);
@@ -889,45 +652,46 @@ int tfs_rename(fileDescriptor fd, char *newName) {
         }
     }
 
-    printf("] Renamed '%s' to '%s'\n", oldFilename, iBlock.filename);
+    tfsLog("] Renamed '%s' to '%s'\n", oldFilename, iBlock.filename);
     return 0;
 }
 
 /*
  * Prints filename of every file in the directory (disk)
  */
-int tfs_readdir() {
+int readdirLocked() {
     int diskFd;
     SuperBlock sBlock;
-    FileEntry *curr = headOFT;
-    /* Check if disk is mounted and open it */
+    FileEntry *curr;
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Error: Failed to open disk '%s'. Exited with status: %d\n",
-                mDisk, OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Error: Failed to read block. Existed with status: %d\n ",
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr("> Error: Failed to read block. Existed with status: %d\n ",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
     }
 
     /* Get filenames from OFT */
-    if (curr == NULL) {
+    if ((curr = nextEntry(NULL)) == NULL) {
         printf("No filenames to print\n");
         return 0;
     }
     while (curr != NULL) {
-        printf("          %s          ", curr->filename);
-        curr = curr->next;
+        // a file open on several fds is listed once
+        FileEntry *prev = nextEntry(NULL);
+        while (prev != NULL && prev != curr &&
+               strcmp(prev->filename, curr->filename) != 0) {
+            prev = nextEntry(prev);
+        }
+        if (prev == curr) {
+            printf("          %s          ", curr->filename);
+        }
+        curr = nextEntry(curr);
         if (curr == NULL) {
             printf("\n");
         }
@@ -942,24 +706,15 @@ int tfs_readdir() {
 int tfs_displayFragments() {
     int diskFd;
     SuperBlock sBlock;
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited displayFragments() with "
-                "status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
             "> Failed to read block. Exited displayFragments() with "
             "status: "
             " %d\n ",
@@ -980,121 +735,108 @@ int tfs_displayFragments() {
 }
 
 /*
- * Shifts all blocks to the left to reduce external
- * fragmentation, leaving free blocks at the end
+ * Reduces external fragmentation. With size < 0 the disk is fully
+ * compacted, leaving one run of free blocks, otherwise files are
+ * moved until there is a free run of at least size blocks. Only the
+ * files the cheapest plan needs are moved, see planHole() and
+ * planSlide()
  */
-int tfs_defrag() {
+int defragLocked(int size) {
     int diskFd;
     SuperBlock sBlock;
-    /* Check if disk is mounted and open it */
+    int len[DMAP_SIZE];
+    int plan[DMAP_SIZE][2];
+    int alt[DMAP_SIZE][2];
+    int nMoves;
+    int nAlt;
+    int cost;
+    int altCost;
+    int moved = 0;
+
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited defrag() with status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
+    }
+    diskFd = mDiskFd;
+
+    /* Blocks claimed by open streams have to stay put */
+    for (FileEntry *curr = nextEntry(NULL); curr != NULL;
+         curr = nextEntry(curr)) {
+        if (curr->strmBlk != NULL) {
+            tfsErr("> Stream is open. Exited defrag() with status: %d\n",
+                   STREAM_ERR);
+            return STREAM_ERR;
         }
     }
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited defrag() with status: %d\n ",
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr("> Failed to read block. Exited defrag() with status: %d\n ",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
     }
-
-    /* Iterate over disk map -> shift taken blocks to where free blocks are */
-    char buf[BLOCKSIZE];
-    int wrIdx = 0;
-
-    for (int rdIdx = 0; rdIdx < sBlock.numBlocks; rdIdx++) {
-        // if the current element is not 'F', shift it to the write index
-        if (sBlock.dMap[rdIdx] != 'F') {
-            // update disk map
-            sBlock.dMap[wrIdx] = sBlock.dMap[rdIdx];
-
-            // update disk by moving blocks
-            if (readBlock(diskFd, rdIdx, &buf) < 0) {
-                printf(
-                    "> Failed to read block. Exited defrag() with status: %d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (writeBlock(diskFd, wrIdx, &buf) < 0) {
-                printf(
-                    "> Failed to write block. Exited defrag() with status: "
-                    "%d\n",
-                    WRITE_BLOCK_ERR);
-                return WRITE_BLOCK_ERR;
-            }
-
-            wrIdx++;
-        }
+    if (size > sBlock.numFree) {
+        tfsErr("> No space to free. Exited defrag() with status: %d\n",
+               NO_SPACE_ERR);
+        return NO_SPACE_ERR;
     }
 
-    // fill the remaining slots with free blocks
-    while (wrIdx < sBlock.numBlocks) {
-        // update disk map
-        sBlock.dMap[wrIdx] = 'F';
-
-        // update disk by wiriting free blocks
-        FreeBlock fBlock;
-        fBlock.type = 4;
-        fBlock.mNum = 0x44;
-        memset(fBlock.data, 0, sizeof(fBlock.data));
+    /* Length of the run starting at each inode */
+    for (int i = 0; i < sBlock.numBlocks; i++) {
+        len[i] = sBlock.dMap[i] == 'I' ? mIndex[i].fcbLen + 1 : 0;
+    }
 
-        if (writeBlock(diskFd, wrIdx, &fBlock) < 0) {
-            return WRITE_BLOCK_ERR;
+    /* Plan with the cheaper of filling holes and sliding files down.
+       A full compaction leaves its free run at the end of the disk,
+       where the background defragmenter would leave it too */
+    if (size < 0) {
+        cost = planHole(sBlock.dMap, len, sBlock.numBlocks, sBlock.numFree,
+                        sBlock.numBlocks - sBlock.numFree, plan, &nMoves);
+    } else {
+        cost = planHole(sBlock.dMap, len, sBlock.numBlocks, size, 1, plan,
+                        &nMoves);
+    }
+    if (size < 0 || cost < 0) {
+        altCost = planSlide(sBlock.dMap, len, sBlock.numBlocks, alt, &nAlt);
+        if (cost < 0 || altCost < cost) {
+            memcpy(plan, alt, sizeof(plan));
+            nMoves = nAlt;
         }
-
-        wrIdx++;
     }
 
-    if (writeBlock(diskFd, 0, &sBlock) < 0) {
-        printf(
-            "> Failed to write block. Exited defrag() with status: "
-            "> Error: Failed in defrag(). Exited with "
-            "status: "
-            "%d\n",
-            WRITE_BLOCK_ERR);
-        return WRITE_BLOCK_ERR;
+    /* Move each file of the plan as one run */
+    for (int i = 0; i < nMoves; i++) {
+        int res = moveFile(diskFd, plan[i][0], plan[i][1]);
+        if (res < 0) {
+            tfsErr("> Failed to move file. Exited defrag() with status: %d\n",
+                   res);
+            return res;
+        }
+        moved += res;
     }
 
-    printf("] Resolved fragmentation\n");
+    tfsLog("] Resolved fragmentation, moved %d blocks\n", moved);
     return 0;
 }
 
 /*
  * Makes a file read only
  */
-int tfs_makeRO(char *name) {
+int makeROLocked(char *name) {
     int diskFd;
     int foundIn = -1;
     SuperBlock sBlock;
     InodeBlock iBlock;
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited makeRO() with "
-                "status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited makeRO() with status: %d\n ",
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr("> Failed to read block. Exited makeRO() with status: %d\n ",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
     }
@@ -1103,7 +845,7 @@ int tfs_makeRO(char *name) {
     for (int i = 0; i < sBlock.numBlocks; i++) {
         if (sBlock.dMap[i] == 'I') {
             if (readBlock(diskFd, i, &iBlock) < 0) {
-                printf(
+                tfsErr(
                     "> Failed to read block. Exited makeRO() with status: "
                     "%d\n",
                     READ_BLOCK_ERR);
@@ -1113,24 +855,25 @@ int tfs_makeRO(char *name) {
                 foundIn = 0;
                 // set to read only
                 iBlock.rdOnly = 0;
+                applyATime(name, &iBlock);
 
                 // write inode back to disk
-                if (writeBlock(diskFd, iBlock.posInDsk, &iBlock) < 0) {
-                    printf(
+                if (writeInode(diskFd, &iBlock) < 0) {
+                    tfsErr(
                         "> Failed to write block. Exited makeRO() with status: "
                         "%d\n",
                         WRITE_BLOCK_ERR);
                     return WRITE_BLOCK_ERR;
                 }
                 // log status
-                printf("] Made '%s' access rights to READ only\n", name);
+                tfsLog("] Made '%s' access rights to READ only\n", name);
                 break;
             }
         }
     }
 
     if (foundIn < 0) {
-        printf("Failed to make '%s' READ only\n", name);
+        tfsErr("Failed to make '%s' READ only\n", name);
     }
 
     return 0;
@@ -1139,30 +882,21 @@ int tfs_makeRO(char *name) {
 /*
  * Makes a file read and write
  */
-int tfs_makeRW(char *name) {
+int makeRWLocked(char *name) {
     int diskFd;
     int foundIn = -1;
     SuperBlock sBlock;
     InodeBlock iBlock;
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited makeRW() with "
-                "status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited makeRW() with status: %d\n ",
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr("> Failed to read block. Exited makeRW() with status: %d\n ",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
     }
@@ -1171,7 +905,7 @@ int tfs_makeRW(char *name) {
     for (int i = 0; i < sBlock.numBlocks; i++) {
         if (sBlock.dMap[i] == 'I') {
             if (readBlock(diskFd, i, &iBlock) < 0) {
-                printf(
+                tfsErr(
                     "> Failed to read block. Exited makeRW() with status: "
                     "%d\n",
                     READ_BLOCK_ERR);
@@ -1181,24 +915,25 @@ int tfs_makeRW(char *name) {
                 foundIn = 0;
                 // set to read and write
                 iBlock.rdOnly = -1;
+                applyATime(name, &iBlock);
 
                 // write inode back to disk
-                if (writeBlock(diskFd, iBlock.posInDsk, &iBlock) < 0) {
-                    printf(
+                if (writeInode(diskFd, &iBlock) < 0) {
+                    tfsErr(
                         "> Failed to write block. Exited makeRW() with status: "
                         "%d\n",
                         WRITE_BLOCK_ERR);
                     return WRITE_BLOCK_ERR;
                 }
                 // log status
-                printf("] Made '%s' access rights to READ and WRITE\n", name);
+                tfsLog("] Made '%s' access rights to READ and WRITE\n", name);
                 break;
             }
         }
     }
 
     if (foundIn < 0) {
-        printf("Failed to make '%s' READ only\n", name);
+        tfsErr("Failed to make '%s' READ only\n", name);
     }
     return 0;
 }
@@ -1206,7 +941,7 @@ int tfs_makeRW(char *name) {
 /*
  * Write byte to file at fp location
  */
-int tfs_writeByte(fileDescriptor fd, uint8_t data) {
+int writeByteLocked(fileDescriptor fd, uint8_t data) {
     int diskFd;
     int fp;
     int fSize;
@@ -1214,136 +949,91 @@ int tfs_writeByte(fileDescriptor fd, uint8_t data) {
     int foundIn = -1;
     char filename[9];
     time_t newTime;
-    FileEntry *curr = headOFT;
-    SuperBlock sBlock;
+    FileEntry *curr;
     InodeBlock iBlock;
     FileContextBlock tmpFCB;
 
-    /* Check if disk is mounted and open it */
+    /* Check if disk is mounted and use its open disk */
     if (mDisk == NULL) {
         return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited writeByte() with status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
     }
+    diskFd = mDiskFd;
 
     /* Confirm fd is in OFT and get assoicate filename */
     int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename
-        }
-        curr = curr->next;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename
     }
     if (foundFd < 0) {
-        printf("> File not in OFT. Exited writeByte() with status: %d\n",
+        tfsErr("> File not in OFT. Exited writeByte() with status: %d\n",
                READ_BYTE_ERR);
         return READ_BYTE_ERR;
     }
 
-    /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
-        printf("> Failed to read block. Exited writeByte() with status: %d\n ",
+    /* Get inode to know file size and fp */
+    int inIdx = entryInode(diskFd, curr, &iBlock);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited writeByte() with status: %d\n",
                READ_BLOCK_ERR);
         return READ_BLOCK_ERR;
-    }
-
-    /* Get inode to know file size and fp */
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if (readBlock(diskFd, i, &iBlock) < 0) {
-                printf(
-                    "> Failed to read block. Exited writeByte() with status: "
-                    "%d\n",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (strcmp(iBlock.filename, filename) == 0) {
-                foundIn = 0;
-                fp = iBlock.fp;
-                fSize = iBlock.fSize;
-                fcbIndex = iBlock.posInDsk + 1;
-                break;
-            }
-        }
+    } else if (inIdx >= 0) {
+        foundIn = 0;
+        fp = curr->fp;
+        fSize = iBlock.fSize;
+        fcbIndex = iBlock.posInDsk + 1;
     }
 
     /* Write byte */
     if (foundIn == 0) {
-        // copying fcb into temp buffer
-        int offset = 0;
-        int rdIdx = fcbIndex;
-        char tmpBuf[iBlock.fcbLen * (BLOCKSIZE - 2)];  // 254 bytes
-        for (int i = 0; i < iBlock.fcbLen; i++) {
-            if (readBlock(diskFd, rdIdx, &tmpFCB) < 0) {
-                printf(
+        // Check if fp did not exceed file size -> write byte at fp
+        if (fp < fSize) {
+            // only the fcb holding fp is read and written back
+            int room = FCB_ROOM(&iBlock);
+            fcbIndex += fp / room;
+            if (readBlock(diskFd, fcbIndex, &tmpFCB) < 0) {
+                tfsErr(
                     "> Failed to read block. Exited writeByte() with status: "
                     "%d\n",
                     READ_BLOCK_ERR);
                 return READ_BLOCK_ERR;
             }
-            memcpy(tmpBuf + offset, tmpFCB.context, sizeof(tmpFCB.context));
-            rdIdx++;
-            offset += sizeof(tmpFCB.context);
-        }
-
-        // Check if fp did not exceed file size -> copy byte at fp to buffer
-        if (fp < fSize) {
-            tmpBuf[fp] = data;
-            fp++;
+            ((char *)&tmpFCB)[FCB_HEAD(&iBlock) + fp % room] = data;
+            curr->fp = fp + 1;
 
             // update time
             time(&newTime);
             iBlock.modTime = newTime;
             iBlock.accessTime = newTime;
+            applyATime(filename, &iBlock);
 
-            // update fp in inode block in disk
-            iBlock.fp = fp;
-            if (writeBlock(diskFd, iBlock.posInDsk, &iBlock) < 0) {
-                printf(
+            // update times in inode block in disk
+            if (writeInode(diskFd, &iBlock) < 0) {
+                tfsErr(
                     "> Failed to write block. Exited writeByte() with status: "
                     "%d\n",
                     WRITE_BLOCK_ERR);
                 return WRITE_BLOCK_ERR;
             }
 
-            // update file context blocks in disk
-            offset = 0;
-            int wrIdx = fcbIndex;
-            for (int i = 0; i < iBlock.fcbLen; i++) {
-                FileContextBlock fcBlock;
-                fcBlock.type = 3;
-                fcBlock.mNum = 0x44;
-                memcpy(fcBlock.context, tmpBuf + offset,
-                       sizeof(fcBlock.context));
-
-                if (writeBlock(diskFd, wrIdx, &fcBlock) < 0) {
-                    printf(
-                        "> Failed to write block. Exited writeByte() with "
-                        "status: "
-                        "%d\n",
-                        WRITE_BLOCK_ERR);
-                    return WRITE_BLOCK_ERR;
-                }
-                wrIdx++;
-                offset += sizeof(fcBlock.context);
+            // update file context block in disk
+            if (writeBlock(diskFd, fcbIndex, &tmpFCB) < 0) {
+                tfsErr(
+                    "> Failed to write block. Exited writeByte() with "
+                    "status: "
+                    "%d\n",
+                    WRITE_BLOCK_ERR);
+                return WRITE_BLOCK_ERR;
             }
         } else {
-            printf(
+            tfsErr(
                 "> Stopped writing byte '%c'. Exited writeByte() with status: "
                 "%d\n",
                 data, WRITE_BYTE_ERR);
             return WRITE_BYTE_ERR;
         }
     } else {
-        printf(
+        tfsErr(
             "> Stopped writing byte '%c'. Exited writeByte() with status: "
             "%d\n",
             data, WRITE_BYTE_ERR);
@@ -1352,228 +1042,3340 @@ int tfs_writeByte(fileDescriptor fd, uint8_t data) {
 
     return 0;
 }
-/*********************** Helper Functions ***********************/
 
 /*
- * Prints create, modify, and access time for a file
+ * Reads up to size bytes from file at the fd's fp into buffer. Returns
+ * the number of bytes read, 0 at end of file
  */
-int tfs_readFileInfo(fileDescriptor fd) {
-    int diskFd;
-    int foundIn = -1;
-    char filename[9];
-    FileEntry *curr = headOFT;
-    SuperBlock sBlock;
-    /* Check if disk is mounted and open it */
-    if (mDisk == NULL) {
-        return NO_DISK_MOUNTED_ERR;
-    } else {
-        // open mounted disk
-        if ((diskFd = openDisk(mDisk, 0)) < 0) {
-            printf(
-                "> Failed to open disk. Exited in readFileInfo() with status: "
-                "%d\n",
-                OPEN_DISK_ERR);
-            return OPEN_DISK_ERR;
-        }
-    }
-
-    /* Confirm fd is in OFT and get associated filename */
-    int foundFd = -1;
-    while (curr != NULL) {
-        if (curr->fd == fd) {
-            foundFd = 0;
-            strcpy(filename, curr->filename);  // getting filename
-        }
-        curr = curr->next;
-    }
-    if (foundFd < 0) {
-        printf("> File not in OFT. Exited readFileInfo() with status: %d\n",
-               WRITE_FILE_ERR);
-        return WRITE_FILE_ERR;
-    }
+int readLocked(fileDescriptor fd, char *buffer, int size) {
+    struct iovec iov;
 
-    /* Get metadata from super block */
-    if ((readBlock(diskFd, 0, &sBlock)) < 0) {
-        printf(
-            "> Failed to read block. Exited readFileInfo() with status: %d\n ",
-            READ_BLOCK_ERR);
-        return READ_BLOCK_ERR;
+    if (buffer == NULL || size < 0) {
+        tfsErr("> Invalid buffer. Exited read() with status: %d\n",
+               READ_BYTE_ERR);
+        return READ_BYTE_ERR;
     }
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    return readFileV(fd, &iov, 1, "read");
+}
 
-    /* Find inode to get size of file */
-    InodeBlock tmpIn;
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if ((readBlock(diskFd, i, &tmpIn)) < 0) {
-                printf(
-                    "> Failed to read block. Exited readFileInfo() with "
-                    "status: %d\n ",
-                    READ_BLOCK_ERR);
-                return READ_BLOCK_ERR;
-            }
-            if (strcmp(tmpIn.filename, filename) == 0) {
-                foundIn = 0;
-                struct tm *cTimeInfo = localtime(&tmpIn.createTime);
-
-                printf("File Create Time: %d-%02d-%02d %02d:%02d:%02d\n",
-                       cTimeInfo->tm_year + 1900, cTimeInfo->tm_mon + 1,
-                       cTimeInfo->tm_mday, cTimeInfo->tm_hour,
-                       cTimeInfo->tm_min, cTimeInfo->tm_sec);
-
-                struct tm *mTimeInfo = localtime(&tmpIn.modTime);
-
-                printf("File Modif Time:  %d-%02d-%02d %02d:%02d:%02d\n",
-                       mTimeInfo->tm_year + 1900, mTimeInfo->tm_mon + 1,
-                       mTimeInfo->tm_mday, mTimeInfo->tm_hour,
-                       mTimeInfo->tm_min, mTimeInfo->tm_sec);
+/*
+ * Reads from file at the fd's fp into iovcnt segments, filling each
+ * before the next. Returns the number of bytes read, 0 at end of file
+ */
+int readvLocked(fileDescriptor fd, struct iovec *iov, int iovcnt) {
+    return readFileV(fd, iov, iovcnt, "readv");
+}
 
-                struct tm *aTimeInfo = localtime(&tmpIn.accessTime);
+/*
+ * Replaces file content with iovcnt segments written back to back
+ */
+int writevLocked(fileDescriptor fd, struct iovec *iov, int iovcnt) {
+    return writeFileV(fd, iov, iovcnt, "writev");
+}
 
-                printf("File Access Time: %d-%02d-%02d %02d:%02d:%02d\n",
-                       aTimeInfo->tm_year + 1900, aTimeInfo->tm_mon + 1,
-                       aTimeInfo->tm_mday, aTimeInfo->tm_hour,
-                       aTimeInfo->tm_min, aTimeInfo->tm_sec);
-                break;
-            }
-        }
-    }
-    if (foundIn < 0) {
-        printf(
-            "> Failed because inode created after write operation. Failed in "
-            "readFileInfo()\n");
+/*
+ * Writes size bytes from buffer into file at offset. Only the fcbs
+ * covering [offset, offset + size) are rewritten; writing past the
+ * end of file extends it. Does not move fp. Returns bytes written
+ */
+int pwriteLocked(fileDescriptor fd, char *buffer, int size, int offset) {
+    if (offset < 0) {
+        tfsErr("> Invalid offset. Exited pwrite() with status: %d\n",
+               WRITE_FILE_ERR);
+        return WRITE_FILE_ERR;
     }
-    return 0;
+    return writeAt(fd, buffer, size, offset, "pwrite");
 }
 
 /*
- * Initializes super block and free blocks and writes the blocks
- * into the recently opened disk
+ * Appends size bytes from buffer to end of file. Fills the last fcb,
+ * then grows into free blocks right after the file when possible.
+ * Returns bytes written
  */
-int setupFS(int diskFd, int numBlocks) {
-    /* Init Super Block */
-    SuperBlock sBlock;
-    sBlock.type = 1;
-    sBlock.mNum = 0x44;
-    sBlock.numBlocks = numBlocks;
+int appendLocked(fileDescriptor fd, char *buffer, int size) {
+    return writeAt(fd, buffer, size, -1, "append");
+}
 
-    // init disk map bit vector
-    char dMap[numBlocks];
-    memset(dMap, 'F', numBlocks);
-    dMap[0] = 'S';  // first block is super block
+/*
+ * Points ptr at a file's content inside a read only mapping of the
+ * disk instead of copying it out. The file must be headerless
+ * (written while mounted with TFS_RAWDATA) or fit in one fcb. ptr
+ * stays valid until unmount and follows in place writes, but not
+ * rewrites or moves of the file. The mapping only sees committed
+ * blocks, so files cannot be mapped while a batch is open
+ */
+int mapFileLocked(fileDescriptor fd, const char **ptr, int *len) {
+    int inIdx;
+    FileEntry *curr;
+    InodeBlock iBlock;
 
-    // putting bit vector into super block
-    memset(sBlock.dMap, 0, sizeof(sBlock.dMap));
-    memcpy(sBlock.dMap, dMap, sizeof(dMap));
+    /* Check if disk is mounted */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
 
-    // put super block into disk
-    if (writeBlock(diskFd, 0, &sBlock) < 0) {
-        return WRITE_BLOCK_ERR;
+    /* Confirm fd is in OFT */
+    curr = getEntry(fd);
+    if (curr == NULL || ptr == NULL || len == NULL) {
+        tfsErr("> File not in OFT. Exited mapFile() with status: %d\n",
+               MAP_FILE_ERR);
+        return MAP_FILE_ERR;
+    }
+    if (mBatch) {
+        tfsErr("> Batch open. Exited mapFile() with status: %d\n", BATCH_ERR);
+        return BATCH_ERR;
     }
 
-    /* Init Free Blocks */
-    FreeBlock fBlock;
-    fBlock.type = 4;
-    fBlock.mNum = 0x44;
+    /* Content has to sit in one piece on disk */
+    inIdx = entryInode(mDiskFd, curr, &iBlock);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited mapFile() with status: %d\n",
+               READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    } else if (inIdx < 0) {
+        tfsErr("> File has no content. Exited mapFile() with status: %d\n",
+               MAP_FILE_ERR);
+        return MAP_FILE_ERR;
+    }
+    if (iBlock.layout != LAYOUT_RAW && iBlock.fcbLen > 1) {
+        tfsErr(
+            "> Content of '%s' is not contiguous. Exited mapFile() with "
+            "status: %d\n",
+            curr->filename, MAP_FILE_ERR);
+        return MAP_FILE_ERR;
+    }
 
-    memset(fBlock.data, 0, sizeof(fBlock.data));
+    /* Cached blocks have to be on disk for the mapping to show them */
+    if (flushDisk(mDiskFd) < 0) {
+        tfsErr("> Failed to write block. Exited mapFile() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
 
-    // put free blocks into disk
-    for (int i = 1; i < numBlocks; i++) {
-        if (writeBlock(diskFd, i, &fBlock) < 0) {
-            return WRITE_BLOCK_ERR;
+    /* Map whole disk once, later calls reuse it */
+    if (mImage == NULL) {
+        mImageLen = (size_t)mSBlock.numBlocks * BLOCKSIZE;
+        mImage = mmap(NULL, mImageLen, PROT_READ, MAP_SHARED, mDiskFd, 0);
+        if (mImage == MAP_FAILED) {
+            mImage = NULL;
+            tfsErr("> Failed to map disk. Exited mapFile() with status: %d\n",
+                   MAP_FILE_ERR);
+            return MAP_FILE_ERR;
         }
     }
 
+    *ptr = mImage + (size_t)(inIdx + 1) * BLOCKSIZE +
+           (iBlock.fcbLen > 0 ? FCB_HEAD(&iBlock) : 0);
+    *len = iBlock.fSize;
+
+    // mapping a file counts as reading it
+    if (touchATime(mDiskFd, curr, &iBlock) < 0) {
+        tfsErr("> Failed to write block. Exited mapFile() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
     return 0;
 }
 
 /*
- * Remove by overwriting inode and FCB with free blocks
+ * Opens a file for streamed writing. Content is written in chunks
+ * with streamWrite() and replaces the file when closeStream() commits
+ * it, until then readers see the old content. Only the block being
+ * filled is buffered, blocks are claimed as the stream grows
  */
-int removeInAndFcb(int diskFd, char *filename) {
-    int rmvIbIndex;
-    int rmvBlocks;
-    int foundIn = -1;
-    SuperBlock sBlock;
-    InodeBlock tmpIn;
+fileDescriptor openStreamLocked(char *name) {
+    fileDescriptor fd;
+    int start;
+    FileEntry *curr;
+    InodeBlock iBlock;
+
+    /* Check if disk is mounted */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+
+    /* Read only files cannot be replaced */
+    if (strlen(name) < sizeof(iBlock.filename) &&
+        findInode(mDiskFd, name, &iBlock) >= 0 && iBlock.rdOnly == 0) {
+        tfsErr(
+            "> File '%s' is READ only. Exited openStream() with status: "
+            "%d\n",
+            name, READ_ONLY_ERR);
+        return READ_ONLY_ERR;
+    }
+
+    /* Reserve inode block at start of largest free run to grow into */
+    if ((start = largestFreeRun(mSBlock.dMap, mSBlock.numBlocks)) < 0) {
+        tfsErr("> No space to write. Exited openStream() with status: %d\n",
+               NO_SPACE_ERR);
+        return NO_SPACE_ERR;
+    }
+    pthread_mutex_lock(&mOftLock);
+    fd = openFileLocked(name);
+    pthread_mutex_unlock(&mOftLock);
+    if (fd < 0) {
+        return fd;
+    }
+    curr = getEntry(fd);
+    if ((curr->strmBlk = malloc(BLOCKSIZE)) == NULL) {
+        closeFileLocked(fd);
+        return NO_SPACE_ERR;
+    }
+
+    // claims stay in memory until the stream is committed
+    setDMap(start, 'C', 1);
+    curr->strmIdx = start;
+    curr->strmLen = 0;
+    curr->strmRoom = mOpts & TFS_RAWDATA ? BLOCKSIZE : BLOCKDATA;
+    memset(curr->strmBlk, 0, BLOCKSIZE);
+    if (curr->strmRoom < BLOCKSIZE) {
+        curr->strmBlk[0] = 3;
+        curr->strmBlk[1] = 0x44;
+    }
+    return fd;
+}
+
+/*
+ * Adds size bytes from buffer to the end of a stream. Whole blocks
+ * go to disk straight from buffer, the rest waits in the stream's
+ * block. Returns bytes written
+ */
+int streamWriteLocked(fileDescriptor fd, char *buffer, int size) {
+    int res;
+    int room;
+    int head;
+    FileEntry *curr;
+
+    /* Check if disk is mounted */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+
+    /* Confirm fd is an open stream */
+    curr = getEntry(fd);
+    if (curr == NULL || curr->strmBlk == NULL || buffer == NULL ||
+        size < 0) {
+        tfsErr("> Not a stream. Exited streamWrite() with status: %d\n",
+               STREAM_ERR);
+        return STREAM_ERR;
+    }
+    if (size > UINT16_MAX - curr->strmLen) {
+        tfsErr("> No space to write. Exited streamWrite() with status: %d\n",
+               NO_SPACE_ERR);
+        return NO_SPACE_ERR;
+    }
+    room = curr->strmRoom;
+    head = BLOCKSIZE - room;
+
+    /* Top up the block being filled */
+    int fill = curr->strmLen % room;
+    int done = size < room - fill ? size : room - fill;
+    memcpy(curr->strmBlk + head + fill, buffer, done);
+    if (fill + done == room) {
+        if ((res = claimStream(mDiskFd, curr, 1)) < 0) {
+            tfsErr(
+                "> No space to write. Exited streamWrite() with status: "
+                "%d\n",
+                res);
+            return res;
+        }
+        if (writeBlock(mDiskFd, curr->strmIdx + 1 + curr->strmLen / room,
+                       curr->strmBlk) < 0) {
+            tfsErr(
+                "> Failed to write block. Exited streamWrite() with status: "
+                "%d\n",
+                WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+        memset(curr->strmBlk + head, 0, room);
+    }
+    curr->strmLen += done;
+
+    /* Write whole blocks straight from buffer */
+    int nBlocks = (size - done) / room;
+    if (nBlocks > 0) {
+        struct iovec iov;
+        struct iovec dIov[2 * nBlocks + 1];
+
+        iov.iov_base = buffer + done;
+        iov.iov_len = nBlocks * room;
+        int nIov = frameBlocks(dIov, &iov, 0, nBlocks * room, room,
+                               curr->strmBlk, 0);
+        if ((res = claimStream(mDiskFd, curr, nBlocks)) < 0) {
+            tfsErr(
+                "> No space to write. Exited streamWrite() with status: "
+                "%d\n",
+                res);
+            return res;
+        }
+        if (writeBlocksv(mDiskFd, curr->strmIdx + 1 + curr->strmLen / room,
+                         dIov, nIov) < 0) {
+            tfsErr(
+                "> Failed to write block. Exited streamWrite() with status: "
+                "%d\n",
+                WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+        done += nBlocks * room;
+        curr->strmLen += nBlocks * room;
+    }
+
+    /* Keep what is left for the next block */
+    memcpy(curr->strmBlk + head, buffer + done, size - done);
+    curr->strmLen += size - done;
+
+    return size;
+}
+
+/*
+ * Commits a stream: writes its last block and inode, frees the old
+ * content of the file and closes the fd
+ */
+int closeStreamLocked(fileDescriptor fd) {
+    int res;
+    int room;
+    int fcbLen;
+    time_t newTime;
+    FileEntry *curr;
+    SuperBlock sBlock;
+    InodeBlock iBlock;
+    InodeBlock oldIn;
+
+    /* Check if disk is mounted */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+
+    /* Confirm fd is an open stream */
+    curr = getEntry(fd);
+    if (curr == NULL || curr->strmBlk == NULL) {
+        tfsErr("> Not a stream. Exited closeStream() with status: %d\n",
+               STREAM_ERR);
+        return STREAM_ERR;
+    }
+    room = curr->strmRoom;
+
+    /* Write partly filled last block */
+    if (curr->strmLen % room != 0) {
+        if ((res = claimStream(mDiskFd, curr, 1)) < 0) {
+            tfsErr(
+                "> No space to write. Exited closeStream() with status: "
+                "%d\n",
+                res);
+            return res;
+        }
+        if (writeBlock(mDiskFd, curr->strmIdx + 1 + curr->strmLen / room,
+                       curr->strmBlk) < 0) {
+            tfsErr(
+                "> Failed to write block. Exited closeStream() with status: "
+                "%d\n",
+                WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+    }
+    fcbLen = (curr->strmLen + room - 1) / room;
+
+    /* Drop old content, stream takes the file's place */
+    memset(&iBlock, 0, sizeof(InodeBlock));
+    iBlock.createTime = curr->initTime;
+    if (findInode(mDiskFd, curr->filename, &oldIn) >= 0) {
+        iBlock.createTime = oldIn.createTime;
+        if (removeInAndFcb(mDiskFd, curr->filename) < 0) {
+            tfsErr(
+                "> Failed to write block. Exited closeStream() with status: "
+                "%d\n",
+                WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+    }
+
+    /* Write inode of stream */
+    time(&newTime);
+    iBlock.type = 2;
+    iBlock.mNum = 0x44;
+    strcpy(iBlock.filename, curr->filename);
+    iBlock.fSize = curr->strmLen;
+    iBlock.fcbLen = fcbLen;
+    iBlock.posInDsk = curr->strmIdx;
+    iBlock.rdOnly = -1;
+    iBlock.layout = room == BLOCKSIZE ? LAYOUT_RAW : LAYOUT_FRAMED;
+    iBlock.modTime = newTime;
+    iBlock.accessTime = newTime;
+    applyATime(curr->filename, &iBlock);
+    if (writeInode(mDiskFd, &iBlock) < 0) {
+        tfsErr(
+            "> Failed to write block. Exited closeStream() with status: "
+            "%d\n",
+            WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+    setDMap(curr->strmIdx, 'I', 1);
+    if (writeSuperBlock(mDiskFd, &sBlock) < 0) {
+        tfsErr(
+            "> Failed to write block. Exited closeStream() with status: "
+            "%d\n",
+            WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    // stream is committed, nothing left to drop on close
+    free(curr->strmBlk);
+    curr->strmBlk = NULL;
+    tfsLog("] Wrote to '%s'\n", curr->filename);
+    return closeFileLocked(fd);
+}
+
+/*
+ * Starts a batch. Until commitBatch() every block a call writes,
+ * super block and inodes included, is kept in memory, so a run of
+ * writeFile, rename, deleteFile, makeRO and makeRW calls rewrites
+ * each block once at commit instead of once per call. Nothing from
+ * the batch is on disk before the commit
+ */
+int beginBatchLocked() {
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    if (mBatch) {
+        tfsErr("> Batch already open. Exited beginBatch() with status: %d\n",
+               BATCH_ERR);
+        return BATCH_ERR;
+    }
+    if (holdDisk(mDiskFd, mSBlock.numBlocks) < 0) {
+        tfsErr("> Failed to hold disk. Exited beginBatch() with status: %d\n",
+               BATCH_ERR);
+        return BATCH_ERR;
+    }
+    mBatch = 1;
+    return 0;
+}
+
+/*
+ * Commits a batch: writes every block it changed once, in block
+ * order, with one write per run of consecutive blocks
+ */
+int commitBatchLocked() {
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    if (!mBatch) {
+        tfsErr("> No batch open. Exited commitBatch() with status: %d\n",
+               BATCH_ERR);
+        return BATCH_ERR;
+    }
+    if (releaseDisk(mDiskFd) < 0) {
+        tfsErr(
+            "> Failed to write block. Exited commitBatch() with status: "
+            "%d\n",
+            WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+    mBatch = 0;
+    tfsLog("] Committed batch\n");
+    return 0;
+}
+
+/*
+ * Starts the async worker pool. Returns a pipe fd that becomes
+ * readable when a request without a callback finishes, each read
+ * of sizeof(int) bytes gives the handle to pass to reap()
+ */
+int tfs_startAsync() {
+    if (mAsyncOn) {
+        return mDonePipe[0];
+    }
+    if (pipe(mDonePipe) < 0) {
+        tfsErr("> Failed to open pipe. Exited startAsync() with status: %d\n",
+               ASYNC_ERR);
+        return ASYNC_ERR;
+    }
+
+    mAsyncOn = 1;
+    for (int i = 0; i < ASYNC_WORKERS; i++) {
+        if (pthread_create(&mWorkers[i], NULL, asyncWorker, NULL) != 0) {
+            // stop the workers that did start
+            pthread_mutex_lock(&mReqLock);
+            mAsyncOn = 0;
+            pthread_cond_broadcast(&mReqCond);
+            pthread_mutex_unlock(&mReqLock);
+            for (int j = 0; j < i; j++) {
+                pthread_join(mWorkers[j], NULL);
+            }
+            close(mDonePipe[0]);
+            close(mDonePipe[1]);
+            mDonePipe[0] = mDonePipe[1] = -1;
+            tfsErr(
+                "> Failed to start worker. Exited startAsync() with status: "
+                "%d\n",
+                ASYNC_ERR);
+            return ASYNC_ERR;
+        }
+    }
+    return mDonePipe[0];
+}
+
+/*
+ * Waits for queued requests to finish, then stops the workers and
+ * closes the completion pipe. Unreaped requests are dropped. Must
+ * not be called from a callback
+ */
+int tfs_stopAsync() {
+    if (!mAsyncOn) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mReqLock);
+    while (mReqHead != -1) {
+        pthread_cond_wait(&mDoneCond, &mReqLock);
+    }
+    mAsyncOn = 0;
+    pthread_cond_broadcast(&mReqCond);
+    pthread_mutex_unlock(&mReqLock);
+
+    for (int i = 0; i < ASYNC_WORKERS; i++) {
+        pthread_join(mWorkers[i], NULL);
+    }
+    for (int i = 0; i < MAX_REQS; i++) {
+        mReqs[i].state = REQ_FREE;
+    }
+    close(mDonePipe[0]);
+    close(mDonePipe[1]);
+    mDonePipe[0] = mDonePipe[1] = -1;
+    return 0;
+}
+
+/*
+ * Queues tfs_read(fd, buffer, size). Returns a request handle, the
+ * result is passed to done or returned by reap()
+ */
+int tfs_aread(fileDescriptor fd, char *buffer, int size, tfsDone done,
+              void *arg) {
+    return submitReq(REQ_READ, fd, buffer, size, 0, done, arg);
+}
+
+/*
+ * Queues tfs_pwrite(fd, buffer, size, offset)
+ */
+int tfs_apwrite(fileDescriptor fd, char *buffer, int size, int offset,
+                tfsDone done, void *arg) {
+    return submitReq(REQ_PWRITE, fd, buffer, size, offset, done, arg);
+}
+
+/*
+ * Queues tfs_writeFile(fd, buffer, size)
+ */
+int tfs_awriteFile(fileDescriptor fd, char *buffer, int size, tfsDone done,
+                   void *arg) {
+    return submitReq(REQ_WRITE, fd, buffer, size, 0, done, arg);
+}
+
+/*
+ * Returns the result of a request queued without a callback, waiting
+ * for it if it has not finished, and frees its handle
+ */
+int tfs_reap(int req) {
+    AsyncReq *aReq;
+    int res;
+
+    if (req < MAX_REQS) {
+        return ASYNC_ERR;
+    }
+    aReq = &mReqs[req % MAX_REQS];
+
+    pthread_mutex_lock(&mReqLock);
+    if (aReq->state == REQ_FREE || aReq->gen != req / MAX_REQS ||
+        aReq->done != NULL) {
+        pthread_mutex_unlock(&mReqLock);
+        tfsErr("> Unknown request. Exited reap() with status: %d\n",
+               ASYNC_ERR);
+        return ASYNC_ERR;
+    }
+    while (aReq->state != REQ_DONE) {
+        pthread_cond_wait(&mDoneCond, &mReqLock);
+    }
+    res = aReq->res;
+    aReq->state = REQ_FREE;
+    pthread_mutex_unlock(&mReqLock);
+    return res;
+}
+
+/*
+ * Copies the metadata of a file into info. Takes no locks and writes
+ * no shared memory, so lookups scale with the number of threads
+ */
+int tfs_lookup(char *name, FileInfo *info) {
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    if (name == NULL || info == NULL || stableLookup(name, -1, info) < 0) {
+        return NO_FILE_ERR;
+    }
+    return 0;
+}
+
+/*
+ * Copies space usage of the mounted disk into stats: free blocks,
+ * largest free run, free runs by size, files and fragmentation.
+ * Counters are kept up to date as blocks are claimed and freed, so
+ * the disk map is not scanned. Takes no locks
+ */
+int tfs_getSpaceStats(SpaceStats *stats) {
+    unsigned seq;
+
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    if (stats == NULL) {
+        return NO_FILE_ERR;
+    }
+
+    do {
+        seq = seqBegin();
+        memset(stats, 0, sizeof(SpaceStats));
+        stats->numBlocks = mapLen();
+        stats->numFree = __atomic_load_n(&mNumFree, __ATOMIC_ACQUIRE);
+        stats->numFiles = __atomic_load_n(&mNumFiles, __ATOMIC_ACQUIRE);
+        for (int len = 1; len <= DMAP_SIZE; len++) {
+            int runs = __atomic_load_n(&mFreeRuns[len], __ATOMIC_ACQUIRE);
+            if (runs > 0) {
+                int bucket = 0;
+                while (bucket < FREE_BUCKETS - 1 && len >> (bucket + 1)) {
+                    bucket++;
+                }
+                stats->freeRuns[bucket] += runs;
+                stats->largestFree = len;
+            }
+        }
+    } while (seqRetry(seq));
+
+    // fcbs always follow their inode, every file is one run of blocks
+    stats->extentsPerFile = stats->numFiles > 0 ? 1.0 : 0.0;
+    if (stats->numFree > 0) {
+        stats->fragIndex =
+            1.0 - (double)stats->largestFree / stats->numFree;
+    }
+    return 0;
+}
+
+/*
+ * Writes every block cached by TFS_WRITEBACK back and flushes the
+ * disk. Waits for calls that are claiming or freeing blocks, blocks
+ * of an open batch stay in memory until it commits
+ */
+int tfs_sync() {
+    int res = 0;
+    int lk = lockFS(-1, NULL, LOCK_ALLOC);
+
+    if (mDisk == NULL) {
+        res = NO_DISK_MOUNTED_ERR;
+    } else if (flushDisk(mDiskFd) < 0 || syncDisk(mDiskFd) < 0) {
+        tfsErr("> Failed to write block. Exited sync() with status: %d\n",
+               WRITE_BLOCK_ERR);
+        res = WRITE_BLOCK_ERR;
+    }
+    unlockFS(lk, LOCK_ALLOC);
+    return res;
+}
+
+/*
+ * Starts a background defragmenter that moves one file at a time
+ * into the free blocks before it, holding only that file's lock and
+ * the allocator lock while it moves. It moves at most budget blocks
+ * per second and keeps running until stopDefrag() or unmount
+ */
+int tfs_startDefrag(int budget) {
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    if (budget <= 0) {
+        tfsErr("> Invalid budget. Exited startDefrag() with status: %d\n",
+               DEFRAG_ERR);
+        return DEFRAG_ERR;
+    }
+
+    pthread_mutex_lock(&mDefragLock);
+    mDefragBudget = budget;  // a running defragmenter picks it up
+    if (!mDefragOn) {
+        mDefragOn = 1;
+        if (pthread_create(&mDefragger, NULL, defragWorker, NULL) != 0) {
+            mDefragOn = 0;
+            pthread_mutex_unlock(&mDefragLock);
+            tfsErr(
+                "> Failed to start defragmenter. Exited startDefrag() with "
+                "status: %d\n",
+                DEFRAG_ERR);
+            return DEFRAG_ERR;
+        }
+    }
+    pthread_mutex_unlock(&mDefragLock);
+    return 0;
+}
+
+/*
+ * Stops the background defragmenter, waiting for the move it is in
+ * the middle of. Must not be called with any lock of a primary
+ * function held
+ */
+int tfs_stopDefrag() {
+    pthread_mutex_lock(&mDefragLock);
+    if (!mDefragOn) {
+        pthread_mutex_unlock(&mDefragLock);
+        return 0;
+    }
+    mDefragOn = 0;
+    pthread_cond_signal(&mDefragCond);
+    pthread_mutex_unlock(&mDefragLock);
+
+    pthread_join(mDefragger, NULL);
+    return 0;
+}
+
+/*
+ * Sets the level of messages printed, TFS_LOG_OFF (the default),
+ * TFS_LOG_ERROR, TFS_LOG_INFO or TFS_LOG_DEBUG. Messages above
+ * TFS_LOG_MAX are compiled out whatever the level. Returns the
+ * previous level
+ */
+int tfs_setLogLevel(int level) {
+    int old = mLogLevel;
+
+    mLogLevel = level;
+    return old;
+}
+
+/*
+ * Turns recording of calls into the trace ring on or off
+ */
+int tfs_setTrace(int on) {
+    __atomic_store_n(&mTraceOn, on, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Copies the last max trace records, at most TRACE_SIZE, into recs
+ * oldest first. Records still being written, or overwritten while
+ * copied, are left out. Returns the number of records copied
+ */
+int tfs_dumpTrace(TraceRec *recs, int max) {
+    uint32_t next = __atomic_load_n(&mTraceNext, __ATOMIC_ACQUIRE);
+    uint32_t first = next > TRACE_SIZE ? next - TRACE_SIZE : 0;
+    int n = 0;
+
+    if (recs == NULL || max <= 0) {
+        return 0;
+    }
+    if (next - first > (uint32_t)max) {
+        first = next - max;
+    }
+    for (uint32_t i = first; i != next; i++) {
+        TraceRec *rec = &mTrace[i % TRACE_SIZE];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        recs[n].seq = i + 1;
+        seqLoad(&recs[n].op, &rec->op,
+                sizeof(TraceRec) - offsetof(TraceRec, op));
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == i + 1) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Copies the statistics of every operation, summed over the shards,
+ * into stats, indexed by OP_*. With reset the counters start again
+ * from 0, calls finishing meanwhile are counted in either the copy
+ * or the next one
+ */
+int tfs_getStats(OpStats stats[NUM_OPS], int reset) {
+    int nCounters = sizeof(OpStats) / sizeof(uint64_t);
+
+    memset(stats, 0, NUM_OPS * sizeof(OpStats));
+    for (int shard = 0; shard < STAT_SHARDS; shard++) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            uint64_t *from = (uint64_t *)&mStats[shard][op];
+            uint64_t *to = (uint64_t *)&stats[op];
+            for (int i = 0; i < nCounters; i++) {
+                to[i] += reset ? __atomic_exchange_n(&from[i], 0,
+                                                     __ATOMIC_RELAXED)
+                               : __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Starts recording every call to the file at path: its operation,
+ * fd, sizes, offsets and result, never the data. The files on disk
+ * and the open fds are written first, so a replay can rebuild them
+ * on a fresh disk. Stops any recording already running
+ */
+int tfs_startRecord(char *path) {
+    RecordHead head;
+    CallRec rec;
+    FILE *file;
+
+    tfs_stopRecord();
+    if ((file = fopen(path, "wb")) == NULL) {
+        tfsErr("> Failed to open '%s'. Exited startRecord() with status: %d\n",
+               path, RECORD_ERR);
+        return RECORD_ERR;
+    }
+
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    pthread_mutex_lock(&mRecordLock);
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, RECORD_MAGIC, sizeof(head.magic));
+    head.version = RECORD_VERSION;
+    head.numBlocks = mDisk != NULL ? mSBlock.numBlocks : 0;
+    head.opts = mOpts;
+    fwrite(&head, sizeof(head), 1, file);
+    mRecord = file;
+    mRecordLast = opStart().startNs;
+
+    /* Files on disk, with their size and read only flag */
+    memset(&rec, 0, sizeof(rec));
+    for (int i = 0; mDisk != NULL && i < mSBlock.numBlocks; i++) {
+        if (mSBlock.dMap[i] == 'I') {
+            rec.op = REC_FILE;
+            rec.fd = -1;
+            rec.arg = mIndex[i].fSize;
+            rec.arg2 = mIndex[i].rdOnly == 0;
+            writeRecord(&rec, mRecordLast, mIndex[i].filename);
+        }
+    }
+
+    /* Open fds, with their file pointer */
+    FileEntry *fEntry = NULL;
+    while ((fEntry = nextEntry(fEntry)) != NULL) {
+        memset(&rec, 0, sizeof(rec));
+        rec.op = OP_OPEN;
+        rec.fd = fEntry->fd;
+        rec.res = fEntry->fd;
+        writeRecord(&rec, mRecordLast, fEntry->filename);
+        if (fEntry->fp > 0) {
+            rec.op = OP_SEEK;
+            rec.arg = fEntry->fp;
+            rec.res = 0;
+            writeRecord(&rec, mRecordLast, NULL);
+        }
+    }
+    __atomic_store_n(&mRecordOn, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mRecordLock);
+    unlockFS(lk, LOCK_ALL);
+
+    // log success
+    tfsLog("] Recording calls to '%s'\n", path);
+    return 0;
+}
+
+/*
+ * Stops recording and writes out what is still buffered
+ */
+int tfs_stopRecord() {
+    int res = 0;
+
+    pthread_mutex_lock(&mRecordLock);
+    __atomic_store_n(&mRecordOn, 0, __ATOMIC_RELAXED);
+    if (mRecord != NULL) {
+        if (ferror(mRecord) || fclose(mRecord) != 0) {
+            tfsErr("> Failed to write recording. Exited stopRecord() with "
+                   "status: %d\n",
+                   RECORD_ERR);
+            res = RECORD_ERR;
+        }
+        mRecord = NULL;
+    }
+    pthread_mutex_unlock(&mRecordLock);
+    return res;
+}
+
+/************************ Thread Safety *************************/
+
+/*
+ * Every primary function locks what it touches and runs its body,
+ * which expects the locks held:
+ *  - a file's lock, picked by hashing its name, is shared by calls
+ *    that only read the file and exclusive for calls that change it
+ *  - the allocator lock guards the super block and disk map, calls
+ *    that can claim or free blocks hold it throughout. mSBlock and
+ *    the inode index are read under a seqlock (seqBegin()), so
+ *    readers looking at them never wait for a writer's I/O
+ *  - the OFT lock guards the slots of the OFT
+ * Locks are taken in that order. Calls that change many files
+ * (mount, unmount, rename, defrag, batches) take every lock. Reads
+ * of different files, or of one file, run at the same time. Each fd
+ * belongs to one thread at a time, its file pointer is not shared.
+ * Lookups (tfs_lookup, tfs_readFileInfo) take no locks, see
+ * stableLookup(). Calls are timed and counted by opStart() and
+ * opEnd(), lock waits included
+ */
+fileDescriptor tfs_openFile(char *name) {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_OFT);
+    fileDescriptor res = openFileLocked(name);
+
+    recordCall(OP_OPEN, res, name, 0, 0, start, res);
+    unlockFS(lk, LOCK_OFT);
+    return opEnd(OP_OPEN, res, start, res, 0);
+}
+
+int tfs_mountOpts(char *diskname, int opts) {
+    tfs_stopAsync();  // workers need the locks to finish
+    tfs_stopDefrag();
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = mountOptsLocked(diskname, opts);
+
+    recordCall(OP_MOUNT, -1, NULL, opts, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_MOUNT, -1, start, res, 0);
+}
+
+int tfs_unmount() {
+    tfs_stopAsync();  // workers need the locks to finish
+    tfs_stopDefrag();
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = unmountLocked();
+
+    recordCall(OP_UNMOUNT, -1, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_UNMOUNT, -1, start, res, 0);
+}
+
+int tfs_closeFile(fileDescriptor fd) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = closeFileLocked(fd);
+
+    recordCall(OP_CLOSE, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_CLOSE, fd, start, res, 0);
+}
+
+int tfs_writeFile(fileDescriptor fd, char *buffer, int size) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = writeFileLocked(fd, buffer, size);
+
+    recordCall(OP_WRITE, fd, NULL, size, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_WRITE, fd, start, res, size);
+}
+
+int tfs_deleteFile(fileDescriptor fd) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = deleteFileLocked(fd);
+
+    recordCall(OP_DELETE, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_DELETE, fd, start, res, 0);
+}
+
+int tfs_readByte(fileDescriptor fd, char *buffer) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_READ);
+    int res = readByteLocked(fd, buffer);
+
+    recordCall(OP_READBYTE, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_READ);
+    return opEnd(OP_READBYTE, fd, start, res, 1);
+}
+
+int tfs_seek(fileDescriptor fd, int offset) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_READ);
+    int res = seekLocked(fd, offset);
+
+    recordCall(OP_SEEK, fd, NULL, offset, 0, start, res);
+    unlockFS(lk, LOCK_READ);
+    return opEnd(OP_SEEK, fd, start, res, 0);
+}
+
+int tfs_rename(fileDescriptor fd, char *newName) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_ALL);
+    int res = renameLocked(fd, newName);
+
+    recordCall(OP_RENAME, fd, newName, 0, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_RENAME, fd, start, res, 0);
+}
+
+int tfs_readdir() {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALLOC | LOCK_OFT);
+    int res = readdirLocked();
+
+    recordCall(OP_READDIR, -1, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_ALLOC | LOCK_OFT);
+    return opEnd(OP_READDIR, -1, start, res, 0);
+}
+
+int tfs_defrag() {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = defragLocked(-1);
+
+    recordCall(OP_DEFRAG, -1, NULL, -1, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_DEFRAG, -1, start, res, 0);
+}
+
+int tfs_defragFor(int size) {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = defragLocked(size < 0 ? 0 : size);
+
+    recordCall(OP_DEFRAG, -1, NULL, size < 0 ? 0 : size, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_DEFRAG, -1, start, res, 0);
+}
+
+int tfs_makeRO(char *name) {
+    OpClock start = opStart();
+    int lk = lockFS(-1, name, LOCK_WRITE);
+    int res = makeROLocked(name);
+
+    recordCall(OP_MAKERO, -1, name, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE);
+    return opEnd(OP_MAKERO, -1, start, res, 0);
+}
+
+int tfs_makeRW(char *name) {
+    OpClock start = opStart();
+    int lk = lockFS(-1, name, LOCK_WRITE);
+    int res = makeRWLocked(name);
+
+    recordCall(OP_MAKERW, -1, name, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE);
+    return opEnd(OP_MAKERW, -1, start, res, 0);
+}
+
+int tfs_writeByte(fileDescriptor fd, uint8_t data) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE);
+    int res = writeByteLocked(fd, data);
+
+    recordCall(OP_WRITEBYTE, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE);
+    return opEnd(OP_WRITEBYTE, fd, start, res, 1);
+}
+
+int tfs_read(fileDescriptor fd, char *buffer, int size) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_READ);
+    int res = readLocked(fd, buffer, size);
+
+    recordCall(OP_READ, fd, NULL, size, 0, start, res);
+    unlockFS(lk, LOCK_READ);
+    return opEnd(OP_READ, fd, start, res, res);
+}
+
+int tfs_readv(fileDescriptor fd, struct iovec *iov, int iovcnt) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_READ);
+    int res = readvLocked(fd, iov, iovcnt);
+    int size = iovBytes(iov, iovcnt);
+
+    recordCall(OP_READV, fd, NULL, size, iovcnt, start, res);
+    unlockFS(lk, LOCK_READ);
+    return opEnd(OP_READV, fd, start, res, res);
+}
+
+int tfs_writev(fileDescriptor fd, struct iovec *iov, int iovcnt) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = writevLocked(fd, iov, iovcnt);
+    int size = iovBytes(iov, iovcnt);
+
+    recordCall(OP_WRITEV, fd, NULL, size, iovcnt, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_WRITEV, fd, start, res, size);
+}
+
+int tfs_pwrite(fileDescriptor fd, char *buffer, int size, int offset) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = pwriteLocked(fd, buffer, size, offset);
+
+    recordCall(OP_PWRITE, fd, NULL, size, offset, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_PWRITE, fd, start, res, size);
+}
+
+int tfs_append(fileDescriptor fd, char *buffer, int size) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = appendLocked(fd, buffer, size);
+
+    recordCall(OP_APPEND, fd, NULL, size, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_APPEND, fd, start, res, size);
+}
+
+int tfs_mapFile(fileDescriptor fd, const char **ptr, int *len) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_READ | LOCK_ALLOC);
+    int res = mapFileLocked(fd, ptr, len);
+
+    recordCall(OP_MAPFILE, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_READ | LOCK_ALLOC);
+    return opEnd(OP_MAPFILE, fd, start, res, 0);
+}
+
+fileDescriptor tfs_openStream(char *name) {
+    OpClock start = opStart();
+    int lk = lockFS(-1, name, LOCK_WRITE | LOCK_ALLOC);
+    fileDescriptor res = openStreamLocked(name);
+
+    recordCall(OP_OPENSTREAM, res, name, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_OPENSTREAM, res, start, res, 0);
+}
+
+int tfs_streamWrite(fileDescriptor fd, char *buffer, int size) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = streamWriteLocked(fd, buffer, size);
+
+    recordCall(OP_STREAMWRITE, fd, NULL, size, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_STREAMWRITE, fd, start, res, size);
+}
+
+int tfs_closeStream(fileDescriptor fd) {
+    OpClock start = opStart();
+    int lk = lockFS(fd, NULL, LOCK_WRITE | LOCK_ALLOC);
+    int res = closeStreamLocked(fd);
+
+    recordCall(OP_CLOSESTREAM, fd, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return opEnd(OP_CLOSESTREAM, fd, start, res, 0);
+}
+
+int tfs_beginBatch() {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = beginBatchLocked();
+
+    recordCall(OP_BEGINBATCH, -1, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_BEGINBATCH, -1, start, res, 0);
+}
+
+int tfs_commitBatch() {
+    OpClock start = opStart();
+    int lk = lockFS(-1, NULL, LOCK_ALL);
+    int res = commitBatchLocked();
+
+    recordCall(OP_COMMITBATCH, -1, NULL, 0, 0, start, res);
+    unlockFS(lk, LOCK_ALL);
+    return opEnd(OP_COMMITBATCH, -1, start, res, 0);
+}
+
+/*********************** Helper Functions ***********************/
+
+/*
+ * Prints create, modify, and access time for a file
+ */
+int tfs_readFileInfo(fileDescriptor fd) {
+    char filename[9];
+    FileInfo info;
+    struct tm timeInfo;
+
+    /* Check if disk is mounted */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+
+    /* Confirm fd is in OFT */
+    if (entryName(fd, filename) < 0) {
+        tfsErr("> File not in OFT. Exited readFileInfo() with status: %d\n",
+               WRITE_FILE_ERR);
+        return WRITE_FILE_ERR;
+    }
+
+    /* Get times from the inode index without taking a file lock */
+    if (stableLookup(NULL, fd, &info) < 0) {
+        tfsErr(
+            "> Failed because inode created after write operation. Failed in "
+            "readFileInfo()\n");
+        return 0;
+    }
+
+    localtime_r(&info.createTime, &timeInfo);
+    printf("File Create Time: %d-%02d-%02d %02d:%02d:%02d\n",
+           timeInfo.tm_year + 1900, timeInfo.tm_mon + 1, timeInfo.tm_mday,
+           timeInfo.tm_hour, timeInfo.tm_min, timeInfo.tm_sec);
+
+    localtime_r(&info.modTime, &timeInfo);
+    printf("File Modif Time:  %d-%02d-%02d %02d:%02d:%02d\n",
+           timeInfo.tm_year + 1900, timeInfo.tm_mon + 1, timeInfo.tm_mday,
+           timeInfo.tm_hour, timeInfo.tm_min, timeInfo.tm_sec);
+
+    // show access time held back by lazytime
+    if (pendingATime(info.filename) > info.accessTime) {
+        info.accessTime = pendingATime(info.filename);
+    }
+    localtime_r(&info.accessTime, &timeInfo);
+    printf("File Access Time: %d-%02d-%02d %02d:%02d:%02d\n",
+           timeInfo.tm_year + 1900, timeInfo.tm_mon + 1, timeInfo.tm_mday,
+           timeInfo.tm_hour, timeInfo.tm_min, timeInfo.tm_sec);
+    return 0;
+}
+
+/*
+ * Initializes super block and writes it into the recently opened
+ * disk. Every other block is marked free in the disk map but left
+ * unwritten; a block that was never written reads back as zeros and
+ * a type of 0 is treated the same as a free block (type 4)
+ */
+int setupFS(int diskFd, int numBlocks) {
+    /* Init Super Block */
+    SuperBlock sBlock;
+    sBlock.type = 1;
+    sBlock.mNum = 0x44;
+    sBlock.numBlocks = numBlocks;
+
+    // init disk map bit vector
+    char dMap[numBlocks];
+    memset(dMap, 'F', numBlocks);
+    dMap[0] = 'S';  // first block is super block
+
+    // putting bit vector into super block
+    memset(sBlock.dMap, 0, sizeof(sBlock.dMap));
+    memcpy(sBlock.dMap, dMap, sizeof(dMap));
+
+    // new disk has nothing to recover
+    sBlock.state = SB_CLEAN;
+    sBlock.numFree = numBlocks - 1;
+
+    // put super block into disk
+    if (writeSuperBlock(diskFd, &sBlock) < 0) {
+        return WRITE_BLOCK_ERR;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the super block of the mounted disk from memory, or
+ * reads it from disk for any other disk
+ */
+int readSuperBlock(int diskFd, SuperBlock *sBlock) {
+    if (mDisk != NULL && diskFd == mDiskFd) {
+        unsigned seq;
+        do {
+            seq = seqBegin();
+            seqLoad(sBlock, &mSBlock, sizeof(SuperBlock));
+        } while (seqRetry(seq));
+        return 0;
+    }
+    return readBlock(diskFd, 0, sBlock);
+}
+
+/*
+ * Writes the super block to disk. The mounted disk's map is changed
+ * with setDMap() beforehand, which keeps its free count, so its super
+ * block is written from memory and copied into sBlock
+ */
+int writeSuperBlock(int diskFd, SuperBlock *sBlock) {
+    if (mDisk != NULL && diskFd == mDiskFd) {
+        seqWriteBegin();
+        __atomic_store_n(&mSBlock.numFree, mNumFree, __ATOMIC_RELEASE);
+        if (sBlock != &mSBlock) {
+            memcpy(sBlock, &mSBlock, sizeof(SuperBlock));
+        }
+        seqWriteEnd();
+    }
+    return writeBlock(diskFd, 0, sBlock);
+}
+
+/*
+ * Rebuilds disk map and free count from the type of every block.
+ * Used when a disk was not cleanly unmounted. Inodes keep only
+ * a run of unclaimed file context blocks, anything else is freed.
+ * Headerless fcbs have no type byte, so their inode claims its run
+ * whatever the blocks hold. A crash while a file moves can leave two
+ * inodes of one name, only the newest is kept
+ */
+int rebuildFS(int diskFd, SuperBlock *sBlock) {
+    int numBlocks = sBlock->numBlocks;
+    char claimed[DMAP_SIZE];
+    char buf[BLOCKSIZE];
+    InodeBlock iBlock;
+    char names[DMAP_SIZE][9];     // name of each kept inode
+    time_t modTimes[DMAP_SIZE];   // modify time of each kept inode
+    uint8_t fcbLens[DMAP_SIZE];   // fcbs of each kept inode
+
+    if (numBlocks > DMAP_SIZE) {
+        numBlocks = DMAP_SIZE;
+        sBlock->numBlocks = numBlocks;
+    }
+
+    /* Map every block by its type byte */
+    sBlock->dMap[0] = 'S';
+    for (int i = 1; i < numBlocks; i++) {
+        if (readBlock(diskFd, i, buf) < 0) {
+            return READ_BLOCK_ERR;
+        }
+        if (buf[0] == 2) {
+            sBlock->dMap[i] = 'I';
+        } else if (buf[0] == 3) {
+            sBlock->dMap[i] = 'C';
+        } else {
+            sBlock->dMap[i] = 'F';
+        }
+    }
+
+    /* Keep inodes whose file context blocks are all present */
+    memset(claimed, 0, sizeof(claimed));
+    for (int i = 1; i < numBlocks; i++) {
+        if (sBlock->dMap[i] != 'I') {
+            continue;
+        }
+        if (readBlock(diskFd, i, &iBlock) < 0) {
+            return READ_BLOCK_ERR;
+        }
+
+        int raw = iBlock.layout == LAYOUT_RAW;
+        int valid = iBlock.mNum == 0x44 && i + iBlock.fcbLen < numBlocks &&
+                    iBlock.layout <= LAYOUT_RAW &&
+                    iBlock.fSize <= iBlock.fcbLen * FCB_ROOM(&iBlock);
+        for (int j = i + 1; valid && j <= i + iBlock.fcbLen; j++) {
+            if ((!raw && sBlock->dMap[j] != 'C') || claimed[j]) {
+                valid = 0;
+            }
+        }
+
+        if (!valid) {
+            sBlock->dMap[i] = 'F';
+            continue;
+        }
+
+        // newer modify time wins, then the longer run a move grew to
+        int dup = 1;
+        while (dup < i && (sBlock->dMap[dup] != 'I' ||
+                           strncmp(names[dup], iBlock.filename, 9) != 0)) {
+            dup++;
+        }
+        if (dup < i) {
+            if (modTimes[dup] > iBlock.modTime ||
+                (modTimes[dup] == iBlock.modTime &&
+                 fcbLens[dup] >= iBlock.fcbLen)) {
+                sBlock->dMap[i] = 'F';
+                continue;
+            }
+            // its fcbs are freed below with the other unclaimed ones
+            sBlock->dMap[dup] = 'F';
+            memset(claimed + dup + 1, 0, fcbLens[dup]);
+        }
+        memcpy(names[i], iBlock.filename, 9);
+        modTimes[i] = iBlock.modTime;
+        fcbLens[i] = iBlock.fcbLen;
+        for (int j = i + 1; j <= i + iBlock.fcbLen; j++) {
+            sBlock->dMap[j] = 'C';
+            claimed[j] = 1;
+        }
+
+        // inode may have been moved without its position updated
+        if (iBlock.posInDsk != i) {
+            iBlock.posInDsk = i;
+            if (writeBlock(diskFd, i, &iBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+        }
+    }
+
+    /* Free file context blocks that no inode owns */
+    int numFree = 0;
+    for (int i = 1; i < numBlocks; i++) {
+        if (sBlock->dMap[i] == 'C' && !claimed[i]) {
+            sBlock->dMap[i] = 'F';
+        }
+        if (sBlock->dMap[i] == 'F') {
+            numFree++;
+        }
+    }
+    sBlock->numFree = numFree;
+
+    return 0;
+}
+
+/*
+ * Remove by overwriting inode and FCB with free blocks
+ */
+int removeInAndFcb(int diskFd, char *filename) {
+    int rmvIbIndex;
+    int rmvBlocks;
+    int foundIn = -1;
+    SuperBlock sBlock;
+    InodeBlock tmpIn;
+
+    /* Get inode and FCBs to delete */
+    if ((rmvIbIndex = findInode(diskFd, filename, &tmpIn)) == READ_BLOCK_ERR) {
+        return READ_BLOCK_ERR;
+    } else if (rmvIbIndex >= 0) {
+        foundIn = 0;
+        rmvBlocks = tmpIn.fcbLen + 1;  // add one bc inode
+    }
+
+    /* Delete inode and associated FCBs */
+    if (foundIn == 0) {
+        FreeBlock fBlock;
+        fBlock.type = 4;
+        fBlock.mNum = 0x44;
+        memset(fBlock.data, 0, sizeof(fBlock.data));
+
+        for (int i = 0; i < rmvBlocks; i++) {
+            if (writeBlock(diskFd, rmvIbIndex + i, &fBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+        }
+
+        // update disk map with new free blocks
+        setDMap(rmvIbIndex, 'F', rmvBlocks);
+    } else {
+        return -1;
+    }
+
+    /* Update super block w/ new free blocks */
+    if (writeSuperBlock(diskFd, &sBlock) < 0) {
+        return WRITE_BLOCK_ERR;
+    }
+
+    return 0;
+}
+
+/*
+ * Checks if there is enough space in write in disk and retuns
+ * index of where to start writing.
+ */
+int getStartBlock(int fcbLen, char dMap[], int numBlocks) {
+    // get index of where to start writing in disk
+    int l = -1;
+    int r = -1;
+
+    for (int i = 0; i < numBlocks; i++) {
+        if (dMap[i] == 'F') {
+            if (l == -1) {
+                // set the left boundary if it's the first 'F'
+                // encountered
+                l = i;
+            }
+            r = i;
+            // check if the window is at least writeBlockSize + 1
+            if ((r - l + 1) >= fcbLen + 1) {
+                return l;
+            }
+        } else {
+            // reset the boundaries if a 'T' is encountered
+            l = -1;
+            r = -1;
+        }
+    }
+    // did not find available size
+    return -1;
+}
+
+/*
+ * Returns OFT entry of fd in one slot lookup, NULL if fd is not open
+ */
+FileEntry *getEntry(fileDescriptor fd) {
+    FileEntry *fEntry;
+
+    if (fd < MAX_OPEN) {
+        return NULL;
+    }
+    fEntry = &mOFT[fd % MAX_OPEN];
+    return fEntry->inUse && fEntry->fd == fd ? fEntry : NULL;
+}
+
+/*
+ * Returns next open entry of OFT after fEntry, first one for NULL
+ */
+FileEntry *nextEntry(FileEntry *fEntry) {
+    int i = fEntry == NULL ? 0 : fEntry - mOFT + 1;
+
+    for (; i < MAX_OPEN; i++) {
+        if (mOFT[i].inUse) {
+            return &mOFT[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Finds the inode of a file. Copies it into iBlock and returns its
+ * block index, -1 if the file has no inode yet
+ */
+int findInode(int diskFd, char *filename, InodeBlock *iBlock) {
+    SuperBlock sBlock;
+    int idx;
+
+    /* Mounted disk is looked up in memory */
+    if (mDisk != NULL && diskFd == mDiskFd) {
+        if ((idx = indexLookup(filename, NULL)) < 0) {
+            return -1;
+        }
+        if (readBlock(diskFd, idx, iBlock) < 0) {
+            return READ_BLOCK_ERR;
+        }
+        return idx;
+    }
+
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        return READ_BLOCK_ERR;
+    }
+
+    for (int i = 0; i < sBlock.numBlocks; i++) {
+        if (sBlock.dMap[i] == 'I') {
+            if (readBlock(diskFd, i, iBlock) < 0) {
+                return READ_BLOCK_ERR;
+            }
+            if (strcmp(iBlock->filename, filename) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Gets the inode of an open file from the block its OFT entry points
+ * at, searching the disk only when the file has none yet or has
+ * moved. Returns the inode index, -1 if the file has no inode yet
+ */
+int entryInode(int diskFd, FileEntry *fEntry, InodeBlock *iBlock) {
+    int idx = fEntry->inIdx;
+    int isInode;
+
+    unsigned seq;
+    do {
+        seq = seqBegin();
+        isInode = idx > 0 && idx < mapLen() && mapAt(idx) == 'I' &&
+                  indexNamed(idx, fEntry->filename);
+    } while (seqRetry(seq));
+    if (isInode) {
+        if (readBlock(diskFd, idx, iBlock) < 0) {
+            return READ_BLOCK_ERR;
+        }
+        if (strcmp(iBlock->filename, fEntry->filename) == 0) {
+            return idx;
+        }
+    }
+    if ((idx = findInode(diskFd, fEntry->filename, iBlock)) >= -1) {
+        fEntry->inIdx = idx;
+    }
+    return idx;
+}
+
+/*
+ * Replaces file content with the iovec segments in order. Segments
+ * go straight into the fcbs with one vectored write, so callers do
+ * not have to join them into one buffer first
+ */
+int writeFileV(fileDescriptor fd, struct iovec *iov, int iovcnt,
+               char *opName) {
+    int diskFd;
+    int size = 0;
+    int ibIndex;
+    int fcbLen;
+    char filename[9];
+    int rdOnlyFlg = -1;
+    time_t initTime = 0;
+    time_t newTime;
+    SuperBlock sBlock;
+    InodeBlock iBlock;
+
+    /* Check if disk is mounted and use its open disk */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    diskFd = mDiskFd;
+
+    /* Confirm fd is in OFT and get associated filename */
+    FileEntry *curr;
+    if ((curr = getEntry(fd)) == NULL) {
+        tfsErr(
+            "> File not in OFT. Exited %s() with status: "
+            "%d\n",
+            opName, WRITE_FILE_ERR);
+        return WRITE_FILE_ERR;
+    }
+    strcpy(filename, curr->filename);  // getting filename and init time
+    initTime = curr->initTime;
+
+    /* Content is the segments back to back */
+    for (int i = 0; i < iovcnt && iov != NULL; i++) {
+        if (iov[i].iov_len > UINT16_MAX - (size_t)size) {
+            size = -1;
+            break;
+        }
+        size += iov[i].iov_len;
+    }
+
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0) || size < 0) {
+        tfsErr(
+            "> File not in OFT. Exited %s() with status: "
+            "%d\n",
+            opName, WRITE_FILE_ERR);
+        return WRITE_FILE_ERR;
+    }
+
+    /* Get write size in terms of blocks, headerless blocks hold more */
+    int layout = mOpts & TFS_RAWDATA ? LAYOUT_RAW : LAYOUT_FRAMED;
+    int room = layout == LAYOUT_RAW ? BLOCKSIZE : BLOCKDATA;
+    fcbLen = (int)ceil((double)size / room);
 
     /* Get metadata from super block */
-    if (readBlock(diskFd, 0, &sBlock) < 0) {
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
+            "> Failed to read block. Exited %s() with status: "
+            "%d\n ",
+            opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    }
+
+    /* Check if inode exists, where the OFT entry last saw it */
+    int foundIn = -1;
+    InodeBlock tmpIn;
+    int inIdx = entryInode(diskFd, curr, &tmpIn);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr(
+            "> Failed to read block. Exited %s() with "
+            "status: %d\n",
+            opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    } else if (inIdx >= 0) {
+        foundIn = 0;
+        rdOnlyFlg = tmpIn.rdOnly;
+    }
+
+    /* If read only flag is set -> return with error */
+    if (rdOnlyFlg == 0) {
+        tfsErr(
+            "> File '%s' is READ only. Exited %s() with status: "
+            "%d\n",
+            filename, opName, READ_ONLY_ERR);
+        return READ_ONLY_ERR;
+    }
+
+    /* If inode exists -> free its run in the disk map only, the blocks
+       are stamped free once it is known which the new run overwrites */
+    if (foundIn == 0) {
+        setDMap(inIdx, 'F', tmpIn.fcbLen + 1);
+    }
+
+    /* Get metadata from super block after deletion */
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
+            "> Failed to read block. Exited %s() with status: "
+            "%d\n ",
+            opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    }
+
+    /* Get start update index of where to write in super block after deletion */
+    if ((ibIndex = getStartBlock(fcbLen, sBlock.dMap, sBlock.numBlocks)) < 0) {
+        if (foundIn == 0) {
+            // if no space -> old run is untouched on disk, claim it again
+            setDMap(inIdx + 1, 'C', tmpIn.fcbLen);
+            setDMap(inIdx, 'I', 1);
+        }
+        tfsErr(
+            "> No space to write. Exited %s() with status: "
+            "%d\n",
+            opName, NO_SPACE_ERR);
+        return NO_SPACE_ERR;
+    }
+
+    /* Free blocks of old run that new run does not overwrite */
+    if (foundIn == 0) {
+        FreeBlock fBlock;
+        fBlock.type = 4;
+        fBlock.mNum = 0x44;
+        memset(fBlock.data, 0, sizeof(fBlock.data));
+        for (int i = inIdx; i <= inIdx + tmpIn.fcbLen; i++) {
+            if ((i < ibIndex || i > ibIndex + fcbLen) &&
+                writeBlock(diskFd, i, &fBlock) < 0) {
+                tfsErr(
+                    "> Failed to write block. Exited %s() with status: "
+                    "%d\n",
+                    opName, WRITE_BLOCK_ERR);
+                return WRITE_BLOCK_ERR;
+            }
+        }
+    }
+
+    /* Get metadata from super block after deletion */
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
+            "> Failed to read block. Exited %s() with status: "
+            "%d\n ",
+            opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    }
+
+    /* Create inode for fd and write block */
+    iBlock.type = 2;
+    iBlock.mNum = 0x44;
+    strcpy(iBlock.filename, filename);
+    iBlock.fSize = size;
+    iBlock.fcbLen = fcbLen;
+    iBlock.fp = 0;  // unused, fp is kept per fd in the OFT
+    iBlock.posInDsk = ibIndex;
+    iBlock.rdOnly = -1;
+    iBlock.layout = layout;
+
+    if (foundIn == -1) {
+        iBlock.createTime = initTime;
+        iBlock.modTime = initTime;
+        iBlock.accessTime = initTime;
+    } else {
+        iBlock.createTime = initTime;
+        time(&newTime);
+        iBlock.modTime = newTime;
+        iBlock.accessTime = newTime;
+    }
+
+    memset(iBlock.data, 0, sizeof(iBlock.data));
+    applyATime(filename, &iBlock);
+
+    /* Write inode and file context blocks to disk in one go */
+    char fcbHead[2] = {3, 0x44};
+    struct iovec dIov[2 * fcbLen + iovcnt + 2];
+
+    dIov[0].iov_base = &iBlock;
+    dIov[0].iov_len = BLOCKSIZE;
+    int nIov = frameBlocks(dIov + 1, iov, 0, size, room, fcbHead, 1) + 1;
+
+    if (writeBlocksv(diskFd, ibIndex, dIov, nIov) < 0) {
+        tfsErr(
+            "> Failed to write block. Exited %s() with status: "
+            "%d\n",
+            opName, WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+    indexInode(ibIndex, &iBlock);
+
+    // update disk map with file context blocks, then the indexed inode
+    setDMap(ibIndex + 1, 'C', fcbLen);
+    setDMap(ibIndex, 'I', 1);
+
+    /* Update super block w/inode */
+    if (writeSuperBlock(diskFd, &sBlock) < 0) {
+        tfsErr(
+            "> Failed to write block. Exited %s() with status: "
+            "%d\n",
+            opName, WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    // new content is read from the start
+    curr->fp = 0;
+
+    // log success
+    tfsLog("] Wrote to '%s'\n", filename);
+
+    return 0;
+}
+
+/*
+ * Reads from file at the fd's fp into the iovec segments in order.
+ * The fcbs covering the read go straight into the segments with one
+ * vectored read and fp is advanced once. Returns the number of bytes
+ * read, 0 at end of file
+ */
+int readFileV(fileDescriptor fd, struct iovec *iov, int iovcnt,
+              char *opName) {
+    int diskFd;
+    int fp;
+    int size = 0;
+    char filename[9];
+    char skip[BLOCKSIZE];
+    FileEntry *curr;
+    InodeBlock iBlock;
+
+    /* Check if disk is mounted and use its open disk */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    diskFd = mDiskFd;
+
+    /* Confirm fd is in OFT and get assoicate filename */
+    int foundFd = -1;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename
+    }
+    if (foundFd < 0 || iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+        tfsErr("> File not in OFT. Exited %s() with status: %d\n", opName,
+               READ_BYTE_ERR);
+        return READ_BYTE_ERR;
+    }
+
+    /* Get inode to know file size and fp */
+    int inIdx = entryInode(diskFd, curr, &iBlock);
+    if (inIdx == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited %s() with status: %d\n",
+               opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    } else if (inIdx < 0) {
+        tfsErr("> Exited %s() with status: %d\n", opName, READ_BYTE_ERR);
+        return READ_BYTE_ERR;
+    }
+
+    /* Clamp read to space in segments and end of file */
+    for (int i = 0; i < iovcnt && size < UINT16_MAX; i++) {
+        size += iov[i].iov_len < UINT16_MAX ? iov[i].iov_len : UINT16_MAX;
+    }
+    fp = curr->fp;
+    if (size > iBlock.fSize - fp) {
+        size = iBlock.fSize - fp;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+
+    /* Read the fcbs covering [fp, fp + size), block headers and the
+       bytes before fp land in skip */
+    int room = FCB_ROOM(&iBlock);
+    int fcb = fp / room;
+    struct iovec dIov[2 * ((size + room - 1) / room + 1) + iovcnt];
+    int nIov = frameBlocks(dIov, iov, fp % room, size, room, skip, 0);
+
+    if (readBlocksv(diskFd, iBlock.posInDsk + 1 + fcb, dIov, nIov) < 0) {
+        tfsErr("> Failed to read block. Exited %s() with status: %d\n",
+               opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    }
+
+    /* Advance fp, update access time once as mount options allow */
+    curr->fp = fp + size;
+    if (touchATime(diskFd, curr, &iBlock) < 0) {
+        tfsErr("> Failed to write block. Exited %s() with status: %d\n",
+               opName, WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    return size;
+}
+
+/*
+ * Fills out with segments that frame size bytes of the caller's iov
+ * as fcbs holding room bytes each, starting ctxOff bytes into the
+ * first fcb's content. Each fcb gets a segment for head (its header
+ * bytes plus ctxOff bytes skipped in the first fcb, left out when
+ * empty) and one per piece of iov it holds. When pad is set the last
+ * fcb is padded with zeros. Returns segment count
+ */
+int frameBlocks(struct iovec *out, struct iovec *iov, int ctxOff, int size,
+                int room, char *head, int pad) {
+    static char zeros[BLOCKSIZE];
+    int nOut = 0;
+    int done = 0;
+    int seg = 0;
+    size_t segOff = 0;
+
+    while (done < size) {
+        int left = room - ctxOff;
+
+        if (BLOCKSIZE - room + ctxOff > 0) {
+            out[nOut].iov_base = head;
+            out[nOut].iov_len = BLOCKSIZE - room + ctxOff;
+            nOut++;
+        }
+        ctxOff = 0;
+
+        // split the caller's segments at fcb boundaries
+        while (left > 0 && done < size) {
+            while (segOff == iov[seg].iov_len) {
+                seg++;
+                segOff = 0;
+            }
+            size_t len = iov[seg].iov_len - segOff;
+            if (len > (size_t)left) {
+                len = left;
+            }
+            if (len > (size_t)(size - done)) {
+                len = size - done;
+            }
+            out[nOut].iov_base = (char *)iov[seg].iov_base + segOff;
+            out[nOut].iov_len = len;
+            nOut++;
+            segOff += len;
+            left -= len;
+            done += len;
+        }
+
+        if (left > 0 && pad) {
+            out[nOut].iov_base = zeros;
+            out[nOut].iov_len = left;
+            nOut++;
+        }
+    }
+    return nOut;
+}
+
+/*
+ * Writes size bytes into file at offset, or at end of file when
+ * offset is -1. Only the fcbs covering the write are touched and
+ * fcbs added for the write are not read. Returns bytes written
+ */
+int writeAt(fileDescriptor fd, char *buffer, int size, int offset,
+            char *opName) {
+    int diskFd;
+    int inIdx;
+    int end;
+    int newSize;
+    int oldFcbLen;
+    char filename[9];
+    time_t initTime;
+    time_t newTime;
+    FileEntry *curr;
+    InodeBlock iBlock;
+    char blk[BLOCKSIZE];
+
+    /* Check if disk is mounted and use its open disk */
+    if (mDisk == NULL) {
+        return NO_DISK_MOUNTED_ERR;
+    }
+    diskFd = mDiskFd;
+
+    /* Confirm fd is in OFT and get associated filename */
+    int foundFd = -1;
+    if ((curr = getEntry(fd)) != NULL) {
+        foundFd = 0;
+        strcpy(filename, curr->filename);  // getting filename and init time
+        initTime = curr->initTime;
+    }
+    if (foundFd < 0 || buffer == NULL || size < 0) {
+        tfsErr("> File not in OFT. Exited %s() with status: %d\n", opName,
+               WRITE_FILE_ERR);
+        return WRITE_FILE_ERR;
+    }
+
+    /* Get inode, or start a new one if file was never written */
+    if ((inIdx = entryInode(diskFd, curr, &iBlock)) == READ_BLOCK_ERR) {
+        tfsErr("> Failed to read block. Exited %s() with status: %d\n",
+               opName, READ_BLOCK_ERR);
+        return READ_BLOCK_ERR;
+    } else if (inIdx < 0) {
+        memset(&iBlock, 0, sizeof(InodeBlock));
+        iBlock.type = 2;
+        iBlock.mNum = 0x44;
+        strcpy(iBlock.filename, filename);
+        iBlock.rdOnly = -1;
+        iBlock.layout = mOpts & TFS_RAWDATA ? LAYOUT_RAW : LAYOUT_FRAMED;
+        iBlock.createTime = initTime;
+    } else if (iBlock.rdOnly == 0) {
+        tfsErr("> File '%s' is READ only. Exited %s() with status: %d\n",
+               filename, opName, READ_ONLY_ERR);
+        return READ_ONLY_ERR;
+    }
+
+    /* File must fit in inode size fields */
+    int room = FCB_ROOM(&iBlock);
+    int head = FCB_HEAD(&iBlock);
+    if (offset < 0) {
+        offset = iBlock.fSize;
+    }
+    end = offset + size;
+    if (end > UINT16_MAX || (end + room - 1) / room > UINT8_MAX) {
+        tfsErr("> No space to write. Exited %s() with status: %d\n", opName,
+               NO_SPACE_ERR);
+        return NO_SPACE_ERR;
+    }
+
+    /* Allocate more fcbs if write extends past the last one */
+    newSize = end > iBlock.fSize ? end : iBlock.fSize;
+    oldFcbLen = inIdx < 0 ? 0 : iBlock.fcbLen;
+    int newFcbLen = (newSize + room - 1) / room;
+    if (inIdx < 0 || newFcbLen > oldFcbLen) {
+        inIdx = growFile(diskFd, &iBlock, inIdx, newFcbLen, offset / room);
+        if (inIdx < 0) {
+            tfsErr("> Failed to grow file. Exited %s() with status: %d\n",
+                   opName, inIdx);
+            return inIdx;
+        }
+    }
+
+    /* Rewrite only the fcbs covering [offset, end) */
+    for (int fcb = offset / room; size > 0 && fcb <= (end - 1) / room; fcb++) {
+        int fcbStart = fcb * room;
+        int ctxOff = offset > fcbStart ? offset - fcbStart : 0;
+        int ctxEnd = end < fcbStart + room ? end - fcbStart : room;
+        int fcbIndex = iBlock.posInDsk + 1 + fcb;
+
+        // partially written fcbs keep the bytes around the write, fcbs
+        // added for this write start out empty
+        if (fcb >= oldFcbLen) {
+            memset(blk, 0, sizeof(blk));
+        } else if (ctxEnd - ctxOff < room) {
+            if (readBlock(diskFd, fcbIndex, blk) < 0) {
+                tfsErr("> Failed to read block. Exited %s() with status: %d\n",
+                       opName, READ_BLOCK_ERR);
+                return READ_BLOCK_ERR;
+            }
+        }
+        if (head > 0) {
+            blk[0] = 3;
+            blk[1] = 0x44;
+        }
+        memcpy(blk + head + ctxOff, buffer + fcbStart + ctxOff - offset,
+               ctxEnd - ctxOff);
+
+        if (writeBlock(diskFd, fcbIndex, blk) < 0) {
+            tfsErr("> Failed to write block. Exited %s() with status: %d\n",
+                   opName, WRITE_BLOCK_ERR);
+            return WRITE_BLOCK_ERR;
+        }
+    }
+
+    /* Update size and times in inode */
+    time(&newTime);
+    iBlock.fSize = newSize;
+    iBlock.modTime = newTime;
+    iBlock.accessTime = newTime;
+    applyATime(filename, &iBlock);
+    if (writeInode(diskFd, &iBlock) < 0) {
+        tfsErr("> Failed to write block. Exited %s() with status: %d\n",
+               opName, WRITE_BLOCK_ERR);
+        return WRITE_BLOCK_ERR;
+    }
+
+    return size;
+}
+
+/*
+ * Gives a file room for newFcbLen file context blocks. Claims the
+ * free blocks right after the file when there are enough of them,
+ * zero filling new fcbs before fcb zeroTo that the caller will not
+ * write. Otherwise moves the file to a free run: old fcbs are copied
+ * over in one read and one write, new fcbs are zero filled and blocks
+ * of the old run are freed. inIdx is -1 for a file without an inode.
+ * Returns the inode index
+ */
+int growFile(int diskFd, InodeBlock *iBlock, int inIdx, int newFcbLen,
+             int zeroTo) {
+    int newIdx;
+    int oldLen = inIdx < 0 ? 0 : iBlock->fcbLen + 1;  // inode and fcbs
+    char dMap[DMAP_SIZE];
+    SuperBlock sBlock;
+
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        return READ_BLOCK_ERR;
+    }
+
+    /* Grow in place if blocks after the run are free */
+    int inPlace = inIdx >= 0 && inIdx + newFcbLen < sBlock.numBlocks;
+    for (int i = inIdx + oldLen; inPlace && i <= inIdx + newFcbLen; i++) {
+        if (sBlock.dMap[i] != 'F') {
+            inPlace = 0;
+        }
+    }
+    if (inPlace) {
+        int nZero = (zeroTo < newFcbLen ? zeroTo : newFcbLen) - (oldLen - 1);
+        if (nZero > 0) {
+            char *run = calloc(nZero, BLOCKSIZE);
+            if (run == NULL) {
+                return NO_SPACE_ERR;
+            }
+            for (int i = 0; i < nZero && FCB_HEAD(iBlock) > 0; i++) {
+                run[i * BLOCKSIZE] = 3;
+                run[i * BLOCKSIZE + 1] = 0x44;
+            }
+            if (writeBlocks(diskFd, inIdx + oldLen, nZero, run) < 0) {
+                free(run);
+                return WRITE_BLOCK_ERR;
+            }
+            free(run);
+        }
+
+        setDMap(inIdx + oldLen, 'C', newFcbLen - (oldLen - 1));
+        iBlock->fcbLen = newFcbLen;
+        if (writeSuperBlock(diskFd, &sBlock) < 0) {
+            return WRITE_BLOCK_ERR;
+        }
+        return inIdx;
+    }
+
+    /* Find a run, letting it overlap the old run if nothing else fits */
+    newIdx = getStartBlock(newFcbLen, sBlock.dMap, sBlock.numBlocks);
+    if (newIdx < 0 && inIdx >= 0) {
+        memcpy(dMap, sBlock.dMap, sizeof(dMap));
+        memset(dMap + inIdx, 'F', oldLen);
+        newIdx = getStartBlock(newFcbLen, dMap, sBlock.numBlocks);
+    }
+    if (newIdx < 0) {
+        return NO_SPACE_ERR;
+    }
+
+    /* Build new fcb run from old fcbs followed by empty ones */
+    char *run = calloc(newFcbLen > 0 ? newFcbLen : 1, BLOCKSIZE);
+    if (run == NULL) {
+        return NO_SPACE_ERR;
+    }
+    if (oldLen > 1 && readBlocks(diskFd, inIdx + 1, oldLen - 1, run) < 0) {
+        free(run);
+        return READ_BLOCK_ERR;
+    }
+    for (int i = oldLen > 1 ? oldLen - 1 : 0;
+         i < newFcbLen && FCB_HEAD(iBlock) > 0; i++) {
+        run[i * BLOCKSIZE] = 3;
+        run[i * BLOCKSIZE + 1] = 0x44;
+    }
+
+    /* Write fcbs, then the inode that points at them, to their new run.
+       Until the old inode is freed a crash leaves two inodes of the file,
+       rebuildFS() keeps the new one */
+    iBlock->posInDsk = newIdx;
+    iBlock->fcbLen = newFcbLen;
+    if (writeBlocks(diskFd, newIdx + 1, newFcbLen, run) < 0 ||
+        writeInode(diskFd, iBlock) < 0) {
+        free(run);
+        return WRITE_BLOCK_ERR;
+    }
+    free(run);
+
+    /* Update disk map with new run */
+    setDMap(newIdx + 1, 'C', newFcbLen);
+    setDMap(newIdx, 'I', 1);
+
+    /* Free blocks of old run that new run does not reuse */
+    FreeBlock fBlock;
+    fBlock.type = 4;
+    fBlock.mNum = 0x44;
+    memset(fBlock.data, 0, sizeof(fBlock.data));
+    for (int i = inIdx; i >= 0 && i < inIdx + oldLen; i++) {
+        if (i < newIdx || i > newIdx + newFcbLen) {
+            if (writeBlock(diskFd, i, &fBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+            setDMap(i, 'F', 1);
+        }
+    }
+    if (writeSuperBlock(diskFd, &sBlock) < 0) {
+        return WRITE_BLOCK_ERR;
+    }
+
+    return newIdx;
+}
+
+/*
+ * Returns start of the largest run of free blocks, -1 if the disk
+ * is full
+ */
+int largestFreeRun(char dMap[], int numBlocks) {
+    int best = -1;
+    int bestLen = 0;
+
+    for (int i = 0; i < numBlocks; i++) {
+        int len = 0;
+        while (i + len < numBlocks && dMap[i + len] == 'F') {
+            len++;
+        }
+        if (len > bestLen) {
+            best = i;
+            bestLen = len;
+        }
+        i += len;
+    }
+    return best;
+}
+
+/*
+ * Claims nBlocks more fcbs for a stream. Takes the free blocks right
+ * after the stream when it can, otherwise copies the stream's blocks
+ * a run at a time to a free run big enough for all of them
+ */
+int claimStream(int diskFd, FileEntry *fEntry, int nBlocks) {
+    int have = fEntry->strmLen / fEntry->strmRoom;
+    int need = have + nBlocks;
+    int oldIdx = fEntry->strmIdx;
+    int newIdx;
+    char dMap[DMAP_SIZE];
+    char run[16 * BLOCKSIZE];
+
+    if (need > UINT8_MAX) {
+        return NO_SPACE_ERR;
+    }
+
+    /* Grow in place if blocks after the stream are free */
+    int inPlace = oldIdx + need < mSBlock.numBlocks;
+    for (int i = oldIdx + 1 + have; inPlace && i <= oldIdx + need; i++) {
+        if (mSBlock.dMap[i] != 'F') {
+            inPlace = 0;
+        }
+    }
+    if (inPlace) {
+        setDMap(oldIdx + 1 + have, 'C', nBlocks);
+        return 0;
+    }
+
+    /* Find a run, it only overlaps the stream's by starting before it
+       so copying forward never overwrites blocks still to be copied */
+    memcpy(dMap, mSBlock.dMap, sizeof(dMap));
+    memset(dMap + oldIdx, 'F', have + 1);
+    if ((newIdx = getStartBlock(need, dMap, mSBlock.numBlocks)) < 0) {
+        return NO_SPACE_ERR;
+    }
+    for (int i = 0; i < have; i += 16) {
+        int n = have - i < 16 ? have - i : 16;
+        if (readBlocks(diskFd, oldIdx + 1 + i, n, run) < 0) {
+            return READ_BLOCK_ERR;
+        }
+        if (writeBlocks(diskFd, newIdx + 1 + i, n, run) < 0) {
+            return WRITE_BLOCK_ERR;
+        }
+    }
+
+    /* Free blocks of old run that new run does not reuse */
+    FreeBlock fBlock;
+    fBlock.type = 4;
+    fBlock.mNum = 0x44;
+    memset(fBlock.data, 0, sizeof(fBlock.data));
+    for (int i = oldIdx; i <= oldIdx + have; i++) {
+        if (i < newIdx || i > newIdx + need) {
+            if (writeBlock(diskFd, i, &fBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+            setDMap(i, 'F', 1);
+        }
+    }
+
+    setDMap(newIdx, 'C', need + 1);
+    fEntry->strmIdx = newIdx;
+    return 0;
+}
+
+/*
+ * Gives back the blocks an uncommitted stream claimed
+ */
+int dropStream(int diskFd, FileEntry *fEntry) {
+    int res = 0;
+    FreeBlock fBlock;
+
+    if (fEntry->strmBlk == NULL) {
+        return 0;
+    }
+    fBlock.type = 4;
+    fBlock.mNum = 0x44;
+    memset(fBlock.data, 0, sizeof(fBlock.data));
+    for (int i = 0; i <= fEntry->strmLen / fEntry->strmRoom; i++) {
+        if (writeBlock(diskFd, fEntry->strmIdx + i, &fBlock) < 0) {
+            res = WRITE_BLOCK_ERR;
+        }
+        setDMap(fEntry->strmIdx + i, 'F', 1);
+    }
+    free(fEntry->strmBlk);
+    fEntry->strmBlk = NULL;
+    return res;
+}
+
+/*
+ * Updates access time of a file after a read, following the mount
+ * options. With lazytime the new time stays in the OFT entry until
+ * the inode is written for another reason, the file is closed or
+ * the disk is unmounted
+ */
+int touchATime(int diskFd, FileEntry *fEntry, InodeBlock *iBlock) {
+    time_t newTime;
+    time_t lastTime = iBlock->accessTime;
+
+    if (mOpts & TFS_NOATIME) {
+        return 0;
+    }
+
+    time(&newTime);
+    if (pendingATime(fEntry->filename) > lastTime) {
+        lastTime = pendingATime(fEntry->filename);
+    }
+
+    // relatime only moves access times not newer than modify time or a day old
+    if ((mOpts & TFS_RELATIME) && lastTime > iBlock->modTime &&
+        newTime - lastTime < RELATIME_SECS) {
+        return 0;
+    }
+    if (mOpts & TFS_LAZYTIME) {
+        // other readers of the file scan every entry's time
+        pthread_mutex_lock(&mOftLock);
+        fEntry->pendATime = newTime;
+        pthread_mutex_unlock(&mOftLock);
+        return 0;
+    }
+
+    iBlock->accessTime = newTime;
+    return writeInode(diskFd, iBlock);
+}
+
+/*
+ * Returns latest access time held back by lazytime for a file,
+ * 0 if there is none
+ */
+time_t pendingATime(char *filename) {
+    time_t lastTime = 0;
+
+    // only lazytime holds times back, others skip the OFT lock
+    if (!(mOpts & TFS_LAZYTIME)) {
+        return 0;
+    }
+    pthread_mutex_lock(&mOftLock);
+    for (FileEntry *curr = nextEntry(NULL); curr != NULL;
+         curr = nextEntry(curr)) {
+        if (strcmp(curr->filename, filename) == 0 &&
+            curr->pendATime > lastTime) {
+            lastTime = curr->pendATime;
+        }
+    }
+    pthread_mutex_unlock(&mOftLock);
+    return lastTime;
+}
+
+/*
+ * Folds access times held back by lazytime into an inode about to
+ * be written and clears them from the OFT
+ */
+void applyATime(char *filename, InodeBlock *iBlock) {
+    time_t pendTime = pendingATime(filename);
+
+    if (pendTime == 0) {
+        return;
+    }
+    if (pendTime > iBlock->accessTime) {
+        iBlock->accessTime = pendTime;
+    }
+    pthread_mutex_lock(&mOftLock);
+    for (FileEntry *curr = nextEntry(NULL); curr != NULL;
+         curr = nextEntry(curr)) {
+        if (strcmp(curr->filename, filename) == 0) {
+            curr->pendATime = 0;
+        }
+    }
+    pthread_mutex_unlock(&mOftLock);
+}
+
+/*
+ * Writes access time held back by lazytime for a file to its inode
+ */
+int flushATime(int diskFd, char *filename) {
+    InodeBlock iBlock;
+
+    if (pendingATime(filename) == 0) {
+        return 0;
+    }
+
+    int inIdx = findInode(diskFd, filename, &iBlock);
+    if (inIdx == READ_BLOCK_ERR) {
+        return READ_BLOCK_ERR;
+    }
+    applyATime(filename, &iBlock);
+    if (inIdx < 0) {
+        return 0;
+    }
+    return writeInode(diskFd, &iBlock);
+}
+
+/*
+ * Takes a free request slot and queues it for the workers. Like an
+ * fd, the handle carries the slot's generation so a reaped handle
+ * never matches a later request
+ */
+int submitReq(int op, fileDescriptor fd, char *buffer, int size, int offset,
+              tfsDone done, void *arg) {
+    AsyncReq *aReq = NULL;
+    int req;
+
+    pthread_mutex_lock(&mReqLock);
+    if (!mAsyncOn) {
+        pthread_mutex_unlock(&mReqLock);
+        tfsErr("> Async not started. Exited submitReq() with status: %d\n",
+               ASYNC_ERR);
+        return ASYNC_ERR;
+    }
+    for (int i = 0; i < MAX_REQS && aReq == NULL; i++) {
+        if (mReqs[i].state == REQ_FREE) {
+            aReq = &mReqs[i];
+            aReq->gen = aReq->gen % (INT_MAX / MAX_REQS - 1) + 1;
+            req = aReq->gen * MAX_REQS + i;
+        }
+    }
+    if (aReq == NULL) {
+        pthread_mutex_unlock(&mReqLock);
+        tfsErr("> Too many requests. Exited submitReq() with status: %d\n",
+               ASYNC_ERR);
+        return ASYNC_ERR;
+    }
+
+    aReq->op = op;
+    aReq->fd = fd;
+    aReq->buffer = buffer;
+    aReq->size = size;
+    aReq->offset = offset;
+    aReq->done = done;
+    aReq->arg = arg;
+    aReq->state = REQ_QUEUED;
+    aReq->next = -1;
+
+    // add to the tail of the queue
+    if (mReqTail == -1) {
+        mReqHead = req % MAX_REQS;
+    } else {
+        mReqs[mReqTail].next = req % MAX_REQS;
+    }
+    mReqTail = req % MAX_REQS;
+    pthread_cond_signal(&mReqCond);
+    pthread_mutex_unlock(&mReqLock);
+    return req;
+}
+
+/*
+ * Worker thread, runs queued requests until stopAsync()
+ */
+void *asyncWorker(void *unused) {
+    AsyncReq *aReq;
+    int idx;
+    int req;
+    int res;
+
+    pthread_mutex_lock(&mReqLock);
+    while (1) {
+        // wait for a queued request whose fd is free
+        while ((idx = takeReq()) == -1 && (mReqHead != -1 || mAsyncOn)) {
+            pthread_cond_wait(&mReqCond, &mReqLock);
+        }
+        if (idx == -1) {
+            break;
+        }
+        aReq = &mReqs[idx];
+        aReq->state = REQ_RUNNING;
+        req = aReq->gen * MAX_REQS + idx;
+        pthread_mutex_unlock(&mReqLock);
+
+        /* Run the call, it takes the locks it needs */
+        if (aReq->op == REQ_READ) {
+            res = tfs_read(aReq->fd, aReq->buffer, aReq->size);
+        } else if (aReq->op == REQ_PWRITE) {
+            res = tfs_pwrite(aReq->fd, aReq->buffer, aReq->size,
+                             aReq->offset);
+        } else {
+            res = tfs_writeFile(aReq->fd, aReq->buffer, aReq->size);
+        }
+
+        /* Complete through the callback or the pipe */
+        if (aReq->done != NULL) {
+            aReq->done(req, res, aReq->arg);
+        }
+        pthread_mutex_lock(&mReqLock);
+        aReq->res = res;
+        if (aReq->done != NULL) {
+            aReq->state = REQ_FREE;
+        } else {
+            aReq->state = REQ_DONE;
+            if (write(mDonePipe[1], &req, sizeof(req)) != sizeof(req)) {
+                tfsErr("> Failed to post request %d to completion pipe\n",
+                       req);
+            }
+        }
+        pthread_cond_broadcast(&mDoneCond);
+        pthread_cond_broadcast(&mReqCond);  // requests on its fd can run
+    }
+    pthread_mutex_unlock(&mReqLock);
+    return NULL;
+}
+
+/*
+ * Unlinks the first queued request whose fd has no request running,
+ * so one fd's requests run one at a time in the order they were
+ * queued, like calls of the one thread an fd belongs to. Called with
+ * mReqLock held. Returns its slot, -1 if there is none
+ */
+int takeReq() {
+    int prev = -1;
+
+    for (int idx = mReqHead; idx != -1; prev = idx, idx = mReqs[idx].next) {
+        int busy = 0;
+        for (int i = 0; i < MAX_REQS && !busy; i++) {
+            busy = mReqs[i].state == REQ_RUNNING &&
+                   mReqs[i].fd == mReqs[idx].fd;
+        }
+        if (busy) {
+            continue;
+        }
+        if (prev == -1) {
+            mReqHead = mReqs[idx].next;
+        } else {
+            mReqs[prev].next = mReqs[idx].next;
+        }
+        if (mReqTail == idx) {
+            mReqTail = prev;
+        }
+        return idx;
+    }
+    return -1;
+}
+
+/*
+ * Moves the file whose inode is at block from so its inode is at
+ * block to, copying inode and fcbs as one run. Blocks of the old run
+ * the new one does not cover are freed. Expects the file's lock and
+ * the allocator lock held and the new run free. Returns the number
+ * of blocks moved
+ */
+int moveFile(int diskFd, int from, int to) {
+    SuperBlock sBlock;
+    InodeBlock iBlock;
+    FreeBlock fBlock;
+    int n;
+
+    if (readBlock(diskFd, from, &iBlock) < 0) {
+        return READ_BLOCK_ERR;
+    }
+    n = iBlock.fcbLen + 1;
+
+    /* Copy the whole run, inode pointing at its new block */
+    char *run = malloc((size_t)n * BLOCKSIZE);
+    if (run == NULL) {
+        return NO_SPACE_ERR;
+    }
+    if (readBlocks(diskFd, from, n, run) < 0) {
+        free(run);
         return READ_BLOCK_ERR;
     }
+    iBlock.posInDsk = to;
+    memcpy(run, &iBlock, BLOCKSIZE);
+    if (writeBlocks(diskFd, to, n, run) < 0) {
+        free(run);
+        return WRITE_BLOCK_ERR;
+    }
+    free(run);
+
+    // index the new inode before the disk map points readers at it
+    indexInode(to, &iBlock);
+    setDMap(to + 1, 'C', n - 1);
+    setDMap(to, 'I', 1);
+
+    /* Free what is left of the old run */
+    fBlock.type = 4;
+    fBlock.mNum = 0x44;
+    memset(fBlock.data, 0, sizeof(fBlock.data));
+    for (int i = from; i < from + n; i++) {
+        if (i < to || i >= to + n) {
+            if (writeBlock(diskFd, i, &fBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+            setDMap(i, 'F', 1);
+        }
+    }
+    if (writeSuperBlock(diskFd, &sBlock) < 0) {
+        return WRITE_BLOCK_ERR;
+    }
+    tfsDbg("] Moved '%s' from block %d to %d\n", iBlock.filename, from, to);
+    return n;
+}
+
+/*
+ * Plans a free run of size blocks by emptying the window of size
+ * blocks from first on whose files are cheapest to move, each into
+ * the smallest free run outside the window it fits in. Of windows
+ * that cost the same the last is taken, keeping files low on the
+ * disk like defragStep() does. len holds the run length of the file
+ * whose inode is at each block. Fills plan with {from, to} moves
+ * that can run in any order and returns the number of blocks they
+ * move, -1 if no window can be emptied
+ */
+int planHole(char dMap[], int len[], int numBlocks, int size, int first,
+             int plan[][2], int *nMoves) {
+    char used[DMAP_SIZE];
+    int moves[DMAP_SIZE][2];
+    int best = -1;
+
+    *nMoves = 0;
+    for (int s = first > 1 ? first : 1; s + size <= numBlocks; s++) {
+        int cost = 0;
+        int n = 0;
+
+        // files overlapping the window, longest first
+        int order[DMAP_SIZE];
+        int nFiles = 0;
+        for (int i = 1; i < s + size; i++) {
+            if (len[i] > 0 && i + len[i] > s) {
+                int j = nFiles++;
+                while (j > 0 && len[order[j - 1]] < len[i]) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+                cost += len[i];
+            }
+        }
+        if (best >= 0 && cost > best) {
+            continue;
+        }
+
+        // place each into the smallest free run that fits
+        memcpy(used, dMap, numBlocks);
+        memset(used + s, 'X', size);
+        for (int f = 0; f < nFiles; f++) {
+            int at = -1;
+            int atLen = numBlocks + 1;
+            for (int i = 1; i < numBlocks; i++) {
+                int run = 0;
+                while (i + run < numBlocks && used[i + run] == 'F') {
+                    run++;
+                }
+                if (run >= len[order[f]] && run < atLen) {
+                    at = i;
+                    atLen = run;
+                }
+                i += run;
+            }
+            if (at < 0) {
+                break;
+            }
+            memset(used + at, 'X', len[order[f]]);
+            moves[n][0] = order[f];
+            moves[n][1] = at;
+            n++;
+        }
+        if (n < nFiles) {
+            continue;
+        }
+
+        best = cost;
+        memcpy(plan, moves, n * sizeof(moves[0]));
+        *nMoves = n;
+    }
+    return best;
+}
 
-    /* Get inode and FCBs to delete */
-    for (int i = 0; i < sBlock.numBlocks; i++) {
-        if (sBlock.dMap[i] == 'I') {
-            if (readBlock(diskFd, i, &tmpIn) < 0) {
-                return READ_BLOCK_ERR;
+/*
+ * Plans a full compaction that slides files down in disk order,
+ * leaving free blocks at the end. Files already in place stay.
+ * Fills plan with {from, to} moves to run in order and returns the
+ * number of blocks they move
+ */
+int planSlide(char dMap[], int len[], int numBlocks, int plan[][2],
+              int *nMoves) {
+    int wrIdx = 1;
+    int cost = 0;
+
+    *nMoves = 0;
+    for (int i = 1; i < numBlocks; i++) {
+        if (len[i] > 0) {
+            if (i != wrIdx) {
+                plan[*nMoves][0] = i;
+                plan[*nMoves][1] = wrIdx;
+                (*nMoves)++;
+                cost += len[i];
             }
-            if (strcmp(tmpIn.filename, filename) == 0) {
-                foundIn = 0;
-                rmvIbIndex = i;
-                rmvBlocks = tmpIn.fcbLen + 1;  // add one bc inode
+            wrIdx += len[i];
+        }
+    }
+    return cost;
+}
+
+/*
+ * Moves the first file that has free blocks right before it to the
+ * start of those blocks. The file is picked without locks, then
+ * checked again once its lock is held. Returns the number of blocks
+ * moved, 0 if no file had to move
+ */
+int defragStep() {
+    char filename[9];
+    unsigned seq;
+    int from;
+    int to;
+    int res = 0;
+
+    /* Pick a file */
+    do {
+        seq = seqBegin();
+        from = -1;
+        to = -1;
+        for (int i = 0; i < mapLen() && from < 0; i++) {
+            char type = mapAt(i);
+            if (type == 'F') {
+                to = to < 0 ? i : to;
+            } else if (type == 'I' && to >= 0) {
+                from = i;
+                seqLoad(filename, mIndex[i].filename, sizeof(filename));
+            } else {
+                to = -1;  // blocks of a stream are not moved
+            }
+        }
+    } while (seqRetry(seq));
+    if (from < 0) {
+        return 0;
+    }
+
+    /* Move it if nothing changed before its lock was taken */
+    int lk = lockFS(-1, filename, LOCK_WRITE | LOCK_ALLOC);
+    int still = mDisk != NULL && mSBlock.dMap[from] == 'I' &&
+                strcmp(mIndex[from].filename, filename) == 0;
+    for (int i = to; still && i < from; i++) {
+        still = mSBlock.dMap[i] == 'F';
+    }
+    if (still) {
+        res = moveFile(mDiskFd, from, to);
+    }
+    unlockFS(lk, LOCK_WRITE | LOCK_ALLOC);
+    return res;
+}
+
+/*
+ * Background defragmenter, moves a file and then sleeps long enough
+ * to stay within the budget, until stopDefrag()
+ */
+void *defragWorker(void *unused) {
+    struct timespec until;
+    int moved;
+    long ms;
+
+    pthread_mutex_lock(&mDefragLock);
+    while (mDefragOn) {
+        pthread_mutex_unlock(&mDefragLock);
+        moved = defragStep();
+        pthread_mutex_lock(&mDefragLock);
+
+        // nothing to move, or failed, waits as long as an idle disk
+        ms = moved > 0 ? moved * 1000L / mDefragBudget : DEFRAG_IDLE_MS;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (until.tv_nsec / 1000000 + ms) / 1000;
+        until.tv_nsec = (until.tv_nsec / 1000000 + ms) % 1000 * 1000000;
+        while (mDefragOn) {
+            if (pthread_cond_timedwait(&mDefragCond, &mDefragLock, &until) ==
+                ETIMEDOUT) {
                 break;
             }
         }
     }
+    pthread_mutex_unlock(&mDefragLock);
+    return NULL;
+}
 
-    /* Delete inode and associated FCBs */
-    if (foundIn == 0) {
-        FreeBlock fBlock;
-        fBlock.type = 4;
-        fBlock.mNum = 0x44;
-        memset(fBlock.data, 0, sizeof(fBlock.data));
+/*
+ * Notes when a call starts and what the calling thread has read and
+ * written so far, to pass to opEnd()
+ */
+OpClock opStart() {
+    OpClock start;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start.startNs = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    diskCounters(&start.io);
+    return start;
+}
 
-        for (int i = 0; i < rmvBlocks; i++) {
-            if (writeBlock(diskFd, rmvIbIndex, &fBlock) < 0) {
-                return WRITE_BLOCK_ERR;
+/*
+ * Adds a finished call to the statistics of the caller's shard and,
+ * while tracing, records it in the trace ring. bytes is what the
+ * call read or wrote for the caller if it succeeded. Trace writers
+ * claim a record by number without a lock, its seq is 0 while it is
+ * filled so tfs_dumpTrace() skips it. Returns res
+ */
+int opEnd(int op, fileDescriptor fd, OpClock start, int res, int bytes) {
+    struct timespec now;
+    DiskCounters io;
+    FileEntry *fEntry;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    diskCounters(&io);
+    int64_t lat = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec -
+                  start.startNs;
+
+    /* Statistics, each thread keeps to its own shard */
+    if (mShard < 0) {
+        mShard = __atomic_fetch_add(&mNextShard, 1, __ATOMIC_RELAXED) %
+                 STAT_SHARDS;
+    }
+    OpStats *stats = &mStats[mShard][op];
+    int bucket = lat < 2 ? 0 : 63 - __builtin_clzll(lat);
+    if (bucket >= LAT_BUCKETS) {
+        bucket = LAT_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->errors, res < 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->blocksRead,
+                       io.blocksRead - start.io.blocksRead, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->blocksWritten,
+                       io.blocksWritten - start.io.blocksWritten,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, res < 0 || bytes < 0 ? 0 : bytes,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->cacheHits, io.cacheHits - start.io.cacheHits,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->cacheMisses,
+                       io.cacheMisses - start.io.cacheMisses,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+
+    /* Trace */
+    if (!__atomic_load_n(&mTraceOn, __ATOMIC_RELAXED)) {
+        return res;
+    }
+    uint32_t n = __atomic_fetch_add(&mTraceNext, 1, __ATOMIC_RELAXED);
+    TraceRec *rec = &mTrace[n % TRACE_SIZE];
+    TraceRec copy;
+
+    // the fd belongs to this thread, so its entry holds still
+    fEntry = fd < 0 ? NULL : getEntry(fd);
+    memset(&copy, 0, sizeof(copy));
+    copy.op = op;
+    copy.fd = fd < 0 ? -1 : fd;
+    copy.block = fEntry != NULL ? fEntry->inIdx : -1;
+    copy.res = res;
+    copy.latUs = lat / 1000;
+    copy.startNs = start.startNs;
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    seqStore(&rec->op, &copy.op, sizeof(TraceRec) - offsetof(TraceRec, op));
+    __atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+/*
+ * Returns the bytes in n segments
+ */
+int iovBytes(struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+
+    for (int i = 0; i < iovcnt && iov != NULL; i++) {
+        size += iov[i].iov_len;
+    }
+    return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+/*
+ * Adds a finished call to the recording, if one is running. Called
+ * before the call's locks are released, so calls that touch the same
+ * files are written in the order they ran
+ */
+void recordCall(int op, fileDescriptor fd, char *name, int arg, int arg2,
+                OpClock start, int res) {
+    CallRec rec;
+
+    if (!__atomic_load_n(&mRecordOn, __ATOMIC_RELAXED)) {
+        return;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.fd = fd;
+    rec.arg = arg;
+    rec.arg2 = arg2;
+    rec.res = res;
+
+    pthread_mutex_lock(&mRecordLock);
+    if (mRecord != NULL) {
+        writeRecord(&rec, start.startNs, name);
+    }
+    pthread_mutex_unlock(&mRecordLock);
+}
+
+/*
+ * Writes one record that started at startNs, and its name if the
+ * operation takes one. Called with mRecordLock held
+ */
+void writeRecord(CallRec *rec, int64_t startNs, char *name) {
+    char recName[9];
+    int64_t gap = (startNs - mRecordLast) / 1000;
+
+    // a call can start before one that took the locks first, never go back
+    rec->gapUs = gap < 0 ? 0 : gap > UINT32_MAX ? UINT32_MAX : gap;
+    if (startNs > mRecordLast) {
+        mRecordLast = startNs;
+    }
+    fwrite(rec, sizeof(CallRec), 1, mRecord);
+    if (recordHasName(rec->op)) {
+        memset(recName, 0, sizeof(recName));
+        if (name != NULL) {
+            strncpy(recName, name, sizeof(recName) - 1);
+        }
+        fwrite(recName, sizeof(recName), 1, mRecord);
+    }
+}
+
+/*
+ * Returns whether records of op are followed by a name
+ */
+int recordHasName(int op) {
+    return op == OP_OPEN || op == OP_RENAME || op == OP_MAKERO ||
+           op == OP_MAKERW || op == OP_OPENSTREAM || op == REC_FILE;
+}
+
+/*
+ * Sets up the locks once, the allocator and OFT locks are recursive
+ * so bodies can call helpers that take them again
+ */
+void initLocks() {
+    pthread_mutexattr_t attr;
+
+    for (int i = 0; i < FILE_LOCKS; i++) {
+        pthread_rwlock_init(&mFileLocks[i], NULL);
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mAllocLock, &attr);
+    pthread_mutex_init(&mOftLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Marks n blocks of the mounted disk's map from idx on as type,
+ * without writing the super block
+ */
+void setDMap(int idx, char type, int n) {
+    seqWriteBegin();
+    for (int i = idx; i < idx + n; i++) {
+        noteBlock(i, type);
+    }
+    seqWriteEnd();
+}
+
+/*
+ * Sets block idx of the mounted disk's map to type and updates the
+ * space counters for that one change. Only the free runs touching
+ * idx are looked at. Called between seqWriteBegin() and seqWriteEnd()
+ */
+void noteBlock(int idx, char type) {
+    char old = mSBlock.dMap[idx];
+    int left = 0;
+    int right = 0;
+
+    if ((old == 'F') != (type == 'F')) {
+        while (idx - left > 0 && mSBlock.dMap[idx - left - 1] == 'F') {
+            left++;
+        }
+        while (idx + right + 1 < mSBlock.numBlocks &&
+               mSBlock.dMap[idx + right + 1] == 'F') {
+            right++;
+        }
+
+        // freeing merges the runs on either side, claiming splits them
+        int sign = type == 'F' ? 1 : -1;
+        addCount(&mFreeRuns[left], -sign);
+        addCount(&mFreeRuns[right], -sign);
+        addCount(&mFreeRuns[left + right + 1], sign);
+        addCount(&mNumFree, sign);
+    }
+    addCount(&mNumFiles, (type == 'I') - (old == 'I'));
+    __atomic_store_n(&mSBlock.dMap[idx], type, __ATOMIC_RELEASE);
+}
+
+/*
+ * Adds n to a space counter for readers of tfs_getSpaceStats(). Only
+ * writers holding the seqlock change counters, so no update is lost
+ */
+void addCount(int *count, int n) {
+    if (n != 0) {
+        __atomic_store_n(count, *count + n, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Counts the free runs, free blocks and inodes of the mounted disk's
+ * map once at mount, noteBlock() keeps them up to date after. Called
+ * between seqWriteBegin() and seqWriteEnd()
+ */
+void countSpace() {
+    int numBlocks = mSBlock.numBlocks;
+
+    for (int len = 0; len <= DMAP_SIZE; len++) {
+        addCount(&mFreeRuns[len], -mFreeRuns[len]);
+    }
+    addCount(&mNumFree, -mNumFree);
+    addCount(&mNumFiles, -mNumFiles);
+    for (int i = 0; i < numBlocks; i++) {
+        int len = 0;
+        if (mSBlock.dMap[i] != 'F') {
+            addCount(&mNumFiles, mSBlock.dMap[i] == 'I');
+            continue;
+        }
+        while (i + len < numBlocks && mSBlock.dMap[i + len] == 'F') {
+            len++;
+        }
+        addCount(&mFreeRuns[len], 1);
+        addCount(&mNumFree, len);
+        i += len - 1;
+    }
+}
+
+/*
+ * Returns the file lock a name hashes to
+ */
+int fileLock(char *name) {
+    unsigned hash = 5381;
+
+    for (int i = 0; i < 8 && name[i] != '\0'; i++) {
+        hash = hash * 33 + (unsigned char)name[i];
+    }
+    return hash % FILE_LOCKS;
+}
+
+/*
+ * Takes the locks a primary function asks for in lock order. The
+ * file is named by name, or by fd's entry when name is NULL. A
+ * rename can change an fd's name while we wait, so the name is
+ * checked again once its lock is held. Returns the file lock taken,
+ * -1 if none, for unlockFS()
+ */
+int lockFS(fileDescriptor fd, char *name, int how) {
+    FileEntry *fEntry;
+    int lk = -1;
+
+    pthread_once(&mLockOnce, initLocks);
+
+    /* File locks */
+    if (how & LOCK_ALL) {
+        for (int i = 0; i < FILE_LOCKS; i++) {
+            pthread_rwlock_wrlock(&mFileLocks[i]);
+            __atomic_add_fetch(&mFileSeq[i], 1, __ATOMIC_SEQ_CST);
+        }
+    } else if (how & (LOCK_READ | LOCK_WRITE)) {
+        while (1) {
+            pthread_mutex_lock(&mOftLock);
+            fEntry = name == NULL ? getEntry(fd) : NULL;
+            if (name != NULL || fEntry != NULL) {
+                lk = fileLock(name != NULL ? name : fEntry->filename);
+            }
+            pthread_mutex_unlock(&mOftLock);
+            if (lk < 0) {
+                break;  // fd not open, the body reports it
             }
 
-            // update disk map with new free block
-            sBlock.dMap[rmvIbIndex] = 'F';
+            if (how & LOCK_WRITE) {
+                pthread_rwlock_wrlock(&mFileLocks[lk]);
+            } else {
+                pthread_rwlock_rdlock(&mFileLocks[lk]);
+            }
 
-            // move to the next block
-            rmvIbIndex++;
+            // a rename may have moved the fd to another lock
+            pthread_mutex_lock(&mOftLock);
+            fEntry = name == NULL ? getEntry(fd) : NULL;
+            int moved = fEntry != NULL && fileLock(fEntry->filename) != lk;
+            pthread_mutex_unlock(&mOftLock);
+            if (!moved) {
+                if (how & LOCK_WRITE) {
+                    __atomic_add_fetch(&mFileSeq[lk], 1, __ATOMIC_SEQ_CST);
+                }
+                break;
+            }
+            pthread_rwlock_unlock(&mFileLocks[lk]);
+            lk = -1;
         }
-    } else {
-        return -1;
     }
 
-    /* Update super block w/ new free blocks */
-    if (writeBlock(diskFd, 0, &sBlock) < 0) {
+    /* Allocator and OFT locks */
+    if (how & (LOCK_ALLOC | LOCK_ALL)) {
+        pthread_mutex_lock(&mAllocLock);
+    }
+    if (how & (LOCK_OFT | LOCK_ALL)) {
+        pthread_mutex_lock(&mOftLock);
+    }
+    return lk;
+}
+
+/*
+ * Drops the locks taken by lockFS()
+ */
+void unlockFS(int lk, int how) {
+    if (how & (LOCK_OFT | LOCK_ALL)) {
+        pthread_mutex_unlock(&mOftLock);
+    }
+    if (how & (LOCK_ALLOC | LOCK_ALL)) {
+        pthread_mutex_unlock(&mAllocLock);
+    }
+    if (how & LOCK_ALL) {
+        for (int i = FILE_LOCKS - 1; i >= 0; i--) {
+            __atomic_add_fetch(&mFileSeq[i], 1, __ATOMIC_SEQ_CST);
+            pthread_rwlock_unlock(&mFileLocks[i]);
+        }
+    } else if (lk >= 0) {
+        if (how & LOCK_WRITE) {
+            __atomic_add_fetch(&mFileSeq[lk], 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_rwlock_unlock(&mFileLocks[lk]);
+    }
+}
+
+/*
+ * Starts a lock-free read of mSBlock and mIndex. Returns the sequence
+ * to pass to seqRetry() once the read is done
+ */
+unsigned seqBegin() {
+    unsigned seq;
+
+    while ((seq = __atomic_load_n(&mSeq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();  // an update is being copied in
+    }
+    return seq;
+}
+
+/*
+ * Returns nonzero if mSBlock or mIndex changed during a read started
+ * with seqBegin(), the read has to be done again. The read loads with
+ * acquires, see seqLoad(), so this load cannot move before them
+ */
+int seqRetry(unsigned seq) {
+    return __atomic_load_n(&mSeq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Starts an update of mSBlock or mIndex, readers retry until
+ * seqWriteEnd(). The update stores with releases, see seqStore(), so
+ * none of its stores is seen before this one
+ */
+void seqWriteBegin() {
+    pthread_mutex_lock(&mSeqLock);
+    __atomic_store_n(&mSeq, mSeq + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Publishes an update started with seqWriteBegin()
+ */
+void seqWriteEnd() {
+    __atomic_store_n(&mSeq, mSeq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mSeqLock);
+}
+
+/*
+ * Copies n bytes that a writer changes with seqStore() while readers
+ * run, ahead of checking the sequence that guards them. Every load is
+ * an acquire, so that check stays after them and a load that sees a
+ * new byte also sees the odd sequence stored before it
+ */
+void seqLoad(void *dst, const void *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ((char *)dst)[i] =
+            __atomic_load_n((const char *)src + i, __ATOMIC_ACQUIRE);
+    }
+}
+
+/*
+ * Copies n bytes that readers copy with seqLoad(), after making the
+ * sequence that guards them odd. Every store is a release, so none
+ * is seen before that sequence
+ */
+void seqStore(void *dst, const void *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __atomic_store_n((char *)dst + i, ((const char *)src)[i],
+                         __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Records the metadata of the inode at block idx in the index. The
+ * entry counts once the disk map marks idx as 'I'
+ */
+void indexInode(int idx, InodeBlock *iBlock) {
+    FileInfo info;
+
+    memset(&info, 0, sizeof(info));
+    memcpy(info.filename, iBlock->filename, sizeof(iBlock->filename));
+    info.filename[8] = '\0';
+    info.fSize = iBlock->fSize;
+    info.fcbLen = iBlock->fcbLen;
+    info.rdOnly = iBlock->rdOnly;
+    info.layout = iBlock->layout;
+    info.createTime = iBlock->createTime;
+    info.modTime = iBlock->modTime;
+    info.accessTime = iBlock->accessTime;
+    seqWriteBegin();
+    seqStore(&mIndex[idx], &info, sizeof(info));
+    seqWriteEnd();
+}
+
+/*
+ * Writes an inode to its block and, on the mounted disk, the index
+ */
+int writeInode(int diskFd, InodeBlock *iBlock) {
+    if (writeBlock(diskFd, iBlock->posInDsk, iBlock) < 0) {
         return WRITE_BLOCK_ERR;
     }
+    if (mDisk != NULL && diskFd == mDiskFd) {
+        indexInode(iBlock->posInDsk, iBlock);
+    }
+    return 0;
+}
+
+/*
+ * Indexes every inode of the mounted disk, at mount and after blocks
+ * were moved
+ */
+int buildIndex(int diskFd) {
+    SuperBlock sBlock;
+    InodeBlock iBlock;
 
+    if (readSuperBlock(diskFd, &sBlock) < 0) {
+        return READ_BLOCK_ERR;
+    }
+    for (int i = 0; i < sBlock.numBlocks; i++) {
+        if (sBlock.dMap[i] == 'I') {
+            if (readBlock(diskFd, i, &iBlock) < 0) {
+                return READ_BLOCK_ERR;
+            }
+            indexInode(i, &iBlock);
+        }
+    }
     return 0;
 }
 
 /*
- * Checks if there is enough space in write in disk and retuns
- * index of where to start writing.
+ * Returns the number of blocks in the mounted disk's map, for reads
+ * under the seqlock
  */
-int getStartBlock(int fcbLen, char dMap[], int numBlocks) {
-    // get index of where to start writing in disk
-    int l = -1;
-    int r = -1;
+int mapLen() {
+    return __atomic_load_n(&mSBlock.numBlocks, __ATOMIC_ACQUIRE);
+}
 
-    for (int i = 0; i < numBlocks; i++) {
-        if (dMap[i] == 'F') {
-            if (l == -1) {
-                // set the left boundary if it's the first 'F'
-                // encountered
-                l = i;
+/*
+ * Returns the type of block i in the mounted disk's map, for reads
+ * under the seqlock
+ */
+char mapAt(int i) {
+    return __atomic_load_n(&mSBlock.dMap[i], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns whether the index entry at block i is named filename, for
+ * reads under the seqlock
+ */
+int indexNamed(int i, char *filename) {
+    char name[9];
+
+    seqLoad(name, mIndex[i].filename, sizeof(name));
+    name[8] = '\0';
+    return strcmp(name, filename) == 0;
+}
+
+/*
+ * Finds a file in the index. Copies its metadata into info unless
+ * info is NULL and returns its inode's block, -1 if it has none
+ */
+int indexLookup(char *filename, FileInfo *info) {
+    unsigned seq;
+    int idx;
+
+    do {
+        seq = seqBegin();
+        idx = -1;
+        for (int i = 0; i < mapLen() && idx < 0; i++) {
+            if (mapAt(i) == 'I' && indexNamed(i, filename)) {
+                idx = i;
+                if (info != NULL) {
+                    seqLoad(info, &mIndex[i], sizeof(FileInfo));
+                }
             }
-            r = i;
-            // check if the window is at least writeBlockSize + 1
-            if ((r - l + 1) >= fcbLen + 1) {
-                return l;
+        }
+    } while (seqRetry(seq));
+    return idx;
+}
+
+/*
+ * Looks a file up without locks, by name or by the name of an open
+ * fd. The fd's name is read from its OFT slot, see entryName(), a
+ * rename or close can change it. The file's lock sequence is odd while a
+ * writer holds the file, which can take several index updates, so
+ * the lookup waits for it and is retried if a writer came and went.
+ * Returns the inode's block, -1 if the file has none or the fd is
+ * not open
+ */
+int stableLookup(char *name, fileDescriptor fd, FileInfo *info) {
+    char filename[9];
+    unsigned fileSeq;
+    int lk;
+    int idx;
+
+    pthread_once(&mLockOnce, initLocks);
+    while (1) {
+        if (name == NULL) {
+            if (entryName(fd, filename) < 0) {
+                return -1;
             }
         } else {
-            // reset the boundaries if a 'T' is encountered
-            l = -1;
-            r = -1;
+            strncpy(filename, name, sizeof(filename));
+        }
+        filename[8] = '\0';
+        lk = fileLock(filename);
+
+        fileSeq = __atomic_load_n(&mFileSeq[lk], __ATOMIC_ACQUIRE);
+        if (fileSeq & 1) {
+            // wait for the writer instead of spinning
+            pthread_rwlock_rdlock(&mFileLocks[lk]);
+            pthread_rwlock_unlock(&mFileLocks[lk]);
+            continue;
+        }
+
+        idx = indexLookup(filename, info);
+
+        // a rename changes the name of the fd and bumps every sequence,
+        // the index was read with acquires so this load comes after it
+        if (__atomic_load_n(&mFileSeq[lk], __ATOMIC_RELAXED) == fileSeq &&
+            (name != NULL || sameName(fd, filename))) {
+            return idx;
         }
     }
-    // did not find available size
-    return -1;
-}
\ No newline at end of file
+}
+
+/*
+ * Copies the name of an open fd without locks. The slot is read
+ * again if open, close or rename changed it meanwhile, see
+ * setEntry(). Returns 0, or -1 if the fd is not open
+ */
+int entryName(fileDescriptor fd, char *filename) {
+    FileEntry *fEntry;
+    unsigned seq;
+    int open;
+
+    if (fd < MAX_OPEN) {
+        return -1;
+    }
+    fEntry = &mOFT[fd % MAX_OPEN];
+    do {
+        while ((seq = __atomic_load_n(&fEntry->nameSeq, __ATOMIC_ACQUIRE)) &
+               1) {
+            sched_yield();  // the slot is being changed
+        }
+        open = __atomic_load_n(&fEntry->inUse, __ATOMIC_ACQUIRE) &&
+               __atomic_load_n(&fEntry->fd, __ATOMIC_ACQUIRE) == fd;
+        seqLoad(filename, fEntry->filename, sizeof(fEntry->filename));
+    } while (__atomic_load_n(&fEntry->nameSeq, __ATOMIC_RELAXED) != seq);
+    return open ? 0 : -1;
+}
+
+/*
+ * Sets the fd, name and use of an OFT slot, name NULL keeps its name.
+ * The slot's sequence is odd meanwhile, so entryName() never sees
+ * half of a change. Called with the OFT lock held
+ */
+void setEntry(FileEntry *fEntry, fileDescriptor fd, char *name, int inUse) {
+    char newName[9];
+
+    strncpy(newName, name != NULL ? name : fEntry->filename,
+            sizeof(newName) - 1);
+    newName[8] = '\0';
+
+    // every store is a release, none moves before the odd sequence
+    __atomic_store_n(&fEntry->nameSeq, fEntry->nameSeq + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fEntry->fd, fd, __ATOMIC_RELEASE);
+    seqStore(fEntry->filename, newName, sizeof(newName));
+    __atomic_store_n(&fEntry->inUse, inUse, __ATOMIC_RELEASE);
+    __atomic_store_n(&fEntry->nameSeq, fEntry->nameSeq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns whether an open fd still has the name filename
+ */
+int sameName(fileDescriptor fd, char *filename) {
+    char now[9];
+
+    return entryName(fd, now) == 0 && strcmp(now, filename) == 0;
+}
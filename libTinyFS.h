@@ -1,12 +1,17 @@
 #ifndef LIBTINYFS_H
 #define LIBTINYFS_H
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -15,25 +20,214 @@
 #include "libDisk.h"
 #include "tinyFS.h"
 
+// Called on a worker thread when an async request finishes
+typedef void (*tfsDone)(int req, int res, void *arg);
+
 typedef struct FileEntry {
     fileDescriptor fd;       // fd of open file
     char filename[9];        // filename only 8 characters
-    struct FileEntry *next;  // LL to be dynamic
+    int fp;                  // file pointer of this fd
+    time_t pendATime;        // access time not yet written (lazytime)
+    int strmIdx;             // inode block reserved by an open stream
+    int strmLen;             // bytes written to the stream so far
+    int strmRoom;            // content bytes per fcb of the stream
+    char *strmBlk;           // fcb being filled, NULL if not a stream
+    int inUse;               // slot holds an open file
+    int gen;                 // times slot was handed out, part of fd
+    int inIdx;               // block of file's inode when last seen, or -1
     time_t initTime;
+    unsigned nameSeq;        // odd while fd, filename or inUse change
 } FileEntry;
 
+#define DMAP_SIZE (BLOCKSIZE - 5)  // max blocks tracked by super block
+#define MAX_OPEN 256               // slots in OFT, max fds open at once
+
+// Super block states, anything but clean is rebuilt on mount
+#define SB_CLEAN 1
+#define SB_DIRTY 2
+
+// Mount options for access time updates, default writes on every read
+#define TFS_NOATIME 0x1   // never update access time
+#define TFS_RELATIME 0x2  // update if older than modify time or a day old
+#define TFS_LAZYTIME 0x4  // hold updates in memory until the inode is written
+#define RELATIME_SECS (24 * 60 * 60)
+
+// Mount option for layout of files written while mounted
+#define TFS_RAWDATA 0x8  // headerless fcbs, content is contiguous on disk
+
+// Mount option for write-back caching of blocks, see cacheDisk()
+#define TFS_WRITEBACK 0x10  // writes return once copied, a flusher writes
+#define WB_AGE_MS 1000      // flusher writes blocks dirty this long
+#define WB_DIRTY_PCT 10     // or all blocks once this share is dirty
+
+// Layout of a file's fcbs, kept in its inode
+#define LAYOUT_FRAMED 0  // each fcb starts with type and mNum
+#define LAYOUT_RAW 1     // fcbs hold content only, typed by the disk map
+
+// Content bytes per fcb and header bytes before them
+#define FCB_ROOM(iBlock) \
+    ((iBlock)->layout == LAYOUT_RAW ? BLOCKSIZE : BLOCKDATA)
+#define FCB_HEAD(iBlock) (BLOCKSIZE - FCB_ROOM(iBlock))
+
+// Async requests, run by a pool of worker threads
+#define MAX_REQS 64      // slots in request table, max requests in flight
+#define ASYNC_WORKERS 2  // worker threads started by startAsync()
+#define REQ_READ 1       // tfs_read()
+#define REQ_PWRITE 2     // tfs_pwrite()
+#define REQ_WRITE 3      // tfs_writeFile()
+
+typedef struct AsyncReq {
+    int op;                // REQ_READ, REQ_PWRITE or REQ_WRITE
+    fileDescriptor fd;     // fd the request runs on
+    char *buffer;          // caller's buffer, untouched until completion
+    int size;              // bytes to move
+    int offset;            // file offset for REQ_PWRITE
+    tfsDone done;          // callback, NULL to complete through reap()
+    void *arg;             // passed to done
+    int res;               // return of the call once finished
+    int state;             // REQ_FREE, REQ_QUEUED, REQ_RUNNING, REQ_DONE
+    int gen;               // times slot was handed out, part of handle
+    int next;              // slot queued after this one, or -1
+} AsyncReq;
+
+#define REQ_FREE 0
+#define REQ_QUEUED 1
+#define REQ_RUNNING 2
+#define REQ_DONE 3
+
+// Background defragmenter, see startDefrag()
+#define DEFRAG_IDLE_MS 1000  // wait before looking again when nothing moved
+
+// Log levels, see tfs_setLogLevel(). Build with -DTFS_LOG_MAX=TFS_LOG_OFF
+// to compile every message out
+#define TFS_LOG_OFF 0    // default, nothing is printed
+#define TFS_LOG_ERROR 1  // failures, "> ..."
+#define TFS_LOG_INFO 2   // finished operations, "] ..."
+#define TFS_LOG_DEBUG 3
+#ifndef TFS_LOG_MAX
+#define TFS_LOG_MAX TFS_LOG_DEBUG
+#endif
+
+// Prints a message of a level, the arguments are only evaluated and
+// formatted when the level is on
+#define tfsLogAt(level, ...)                                  \
+    do {                                                      \
+        if ((level) <= TFS_LOG_MAX && (level) <= mLogLevel) { \
+            printf(__VA_ARGS__);                              \
+        }                                                     \
+    } while (0)
+#define tfsErr(...) tfsLogAt(TFS_LOG_ERROR, __VA_ARGS__)
+#define tfsLog(...) tfsLogAt(TFS_LOG_INFO, __VA_ARGS__)
+#define tfsDbg(...) tfsLogAt(TFS_LOG_DEBUG, __VA_ARGS__)
+
+// Operations of the primary functions, for traces
+#define OP_OPEN 0
+#define OP_MOUNT 1
+#define OP_UNMOUNT 2
+#define OP_CLOSE 3
+#define OP_WRITE 4
+#define OP_DELETE 5
+#define OP_READBYTE 6
+#define OP_SEEK 7
+#define OP_RENAME 8
+#define OP_READDIR 9
+#define OP_DEFRAG 10
+#define OP_MAKERO 11
+#define OP_MAKERW 12
+#define OP_WRITEBYTE 13
+#define OP_READ 14
+#define OP_READV 15
+#define OP_WRITEV 16
+#define OP_PWRITE 17
+#define OP_APPEND 18
+#define OP_MAPFILE 19
+#define OP_OPENSTREAM 20
+#define OP_STREAMWRITE 21
+#define OP_CLOSESTREAM 22
+#define OP_BEGINBATCH 23
+#define OP_COMMITBATCH 24
+#define NUM_OPS 25
+
+// Trace of finished calls, see tfs_setTrace()
+#define TRACE_SIZE 4096  // records kept, newer ones overwrite the oldest
+
+typedef struct TraceRec {
+    uint32_t seq;     // record number + 1, 0 while it is written
+    uint16_t op;      // OP_* of the call
+    int32_t fd;       // fd the call ran on, -1 if none
+    int32_t block;    // file's inode block after the call, -1 if none
+    int32_t res;      // value the call returned
+    uint32_t latUs;   // microseconds the call took, lock waits included
+    int64_t startNs;  // monotonic clock when the call started
+} TraceRec;
+
+// Statistics of each operation, see tfs_getStats()
+#define STAT_SHARDS 16  // threads past this many share shards
+#define LAT_BUCKETS 40  // bucket b counts calls of 2^b to 2^(b+1) - 1 ns
+
+typedef struct OpStats {
+    uint64_t calls;
+    uint64_t errors;                // calls that returned an error
+    uint64_t blocksRead;            // blocks read by the calls
+    uint64_t blocksWritten;         // blocks written, held or not
+    uint64_t bytes;                 // bytes read or written for callers
+    uint64_t cacheHits;             // blocks read from held blocks
+    uint64_t cacheMisses;           // blocks read from the disk
+    uint64_t latency[LAT_BUCKETS];  // calls by how long they took
+} OpStats;
+
+// Start of a call, see opStart()
+typedef struct OpClock {
+    int64_t startNs;  // monotonic clock when the call started
+    DiskCounters io;  // blocks the thread had moved by then
+} OpClock;
+
+// Recording of calls to a file, see tfs_startRecord()
+#define RECORD_MAGIC "TFSR"
+#define RECORD_VERSION 1
+#define REC_FILE NUM_OPS  // file on disk when recording started
+
+typedef struct RecordHead {
+    char magic[4];       // RECORD_MAGIC
+    uint16_t version;    // RECORD_VERSION
+    uint16_t numBlocks;  // blocks of the mounted disk, 0 if none was
+    int32_t opts;        // mount options of the mounted disk
+} RecordHead;
+
+// One call, followed by 9 bytes of name if recordHasName(op)
+typedef struct CallRec {
+    uint32_t gapUs;  // microseconds since the previous call started
+    int32_t fd;      // fd passed in, or returned by opens
+    int32_t arg;     // size, offset, options or free run, by op
+    int32_t arg2;    // offset of pwrite, segments of readv and writev
+    int32_t res;     // value the call returned
+    uint8_t op;      // OP_* of the call, or REC_FILE
+} CallRec;
+
+extern int mLogLevel;
+
+// Locks taken by a primary function, see lockFS()
+#define FILE_LOCKS 64    // file locks, a file uses the one its name hashes to
+#define LOCK_READ 0x1    // file lock shared
+#define LOCK_WRITE 0x2   // file lock exclusive
+#define LOCK_ALLOC 0x4   // allocator lock, super block and disk map
+#define LOCK_OFT 0x8     // OFT lock
+#define LOCK_ALL 0x10    // every lock, file locks exclusive
+
 typedef struct SuperBlock {
-    char type;                 // 1
-    char mNum;                 // 0x44
-    uint8_t numBlocks;         // num of blocks in disk
-    char dMap[BLOCKSIZE - 3];  // map of disk (S,I,F,C for block types)
+    char type;             // 1
+    char mNum;             // 0x44
+    uint8_t numBlocks;     // num of blocks in disk
+    char dMap[DMAP_SIZE];  // map of disk (S,I,F,C for block types)
+    uint8_t state;         // SB_CLEAN after unmount, SB_DIRTY while mounted
+    uint8_t numFree;       // num of free blocks, trusted when clean
 } SuperBlock;
 
 typedef struct InodeBlock {
     char type;
     char mNum;
     char filename[9];
-    uint16_t fp;
+    uint16_t fp;  // unused, fp is kept per fd in FileEntry
     uint16_t fSize;
     uint8_t fcbLen;
     uint8_t posInDsk;
@@ -41,9 +235,38 @@ typedef struct InodeBlock {
     time_t createTime;
     time_t modTime;
     time_t accessTime;
-    char data[BLOCKSIZE - 21];
+    uint8_t layout;  // LAYOUT_FRAMED or LAYOUT_RAW
+    char data[BLOCKSIZE - 22];
 } InodeBlock;
 
+// Metadata of a file kept in memory for lookups, see tfs_lookup()
+typedef struct FileInfo {
+    char filename[9];
+    uint16_t fSize;
+    uint8_t fcbLen;
+    uint8_t rdOnly;
+    uint8_t layout;
+    time_t createTime;
+    time_t modTime;
+    time_t accessTime;  // as on disk, without lazytime updates
+} FileInfo;
+
+// Space usage of the mounted disk, see tfs_getSpaceStats()
+#define FREE_BUCKETS 8  // free runs of 1, 2-3, 4-7, ... 128 and more blocks
+
+typedef struct SpaceStats {
+    int numBlocks;                // blocks in disk
+    int numFree;                  // free blocks
+    int largestFree;              // blocks in the largest free run
+    int freeRuns[FREE_BUCKETS];   // free runs by size, bucket b holds
+                                  // runs of 2^b to 2^(b+1) - 1 blocks
+    int numFiles;                 // files with an inode
+    double extentsPerFile;        // runs of blocks per file, 1 with any
+                                  // file: an inode's fcbs always follow
+                                  // it, so nothing is counted
+    double fragIndex;             // 1 - largestFree / numFree, 0 is none
+} SpaceStats;
+
 typedef struct FileContextBlock {
     char type;                    // 3
     char mNum;                    // 0x44
@@ -51,7 +274,7 @@ typedef struct FileContextBlock {
 } FileContextBlock;
 
 typedef struct FreeBlock {
-    char type;                 // 4
+    char type;                 // 4 (0 if never written)
     char mNum;                 // 0x44
     char data[BLOCKSIZE - 2];  // all 0x00
 } FreeBlock;
@@ -59,6 +282,7 @@ typedef struct FreeBlock {
 /* Primary Functions */
 int tfs_mkfs(char *filename, int nBytes);
 int tfs_mount(char *diskname);
+int tfs_mountOpts(char *diskname, int opts);
 int tfs_unmount();
 fileDescriptor tfs_openFile(char *name);
 int tfs_closeFile(fileDescriptor fd);
@@ -69,6 +293,7 @@ int tfs_seek(fileDescriptor fd, int offset);
 
 /* Additional Functionality */
 int tfs_defrag();
+int tfs_defragFor(int size);
 int tfs_rename(fileDescriptor fd, char *newName);
 int tfs_readdir();
 int tfs_displayFragments();
@@ -76,9 +301,134 @@ int tfs_readFileInfo(fileDescriptor fd);
 int tfs_makeRO(char *name);
 int tfs_makeRW(char *name);
 int tfs_writeByte(fileDescriptor fd, uint8_t data);
+int tfs_read(fileDescriptor fd, char *buffer, int size);
+int tfs_pwrite(fileDescriptor fd, char *buffer, int size, int offset);
+int tfs_append(fileDescriptor fd, char *buffer, int size);
+int tfs_readv(fileDescriptor fd, struct iovec *iov, int iovcnt);
+int tfs_writev(fileDescriptor fd, struct iovec *iov, int iovcnt);
+int tfs_mapFile(fileDescriptor fd, const char **ptr, int *len);
+fileDescriptor tfs_openStream(char *name);
+int tfs_streamWrite(fileDescriptor fd, char *buffer, int size);
+int tfs_closeStream(fileDescriptor fd);
+int tfs_beginBatch();
+int tfs_commitBatch();
+int tfs_startAsync();
+int tfs_stopAsync();
+int tfs_aread(fileDescriptor fd, char *buffer, int size, tfsDone done,
+              void *arg);
+int tfs_apwrite(fileDescriptor fd, char *buffer, int size, int offset,
+                tfsDone done, void *arg);
+int tfs_awriteFile(fileDescriptor fd, char *buffer, int size, tfsDone done,
+                   void *arg);
+int tfs_reap(int req);
+int tfs_lookup(char *name, FileInfo *info);
+int tfs_sync();
+int tfs_getSpaceStats(SpaceStats *stats);
+int tfs_setLogLevel(int level);
+int tfs_setTrace(int on);
+int tfs_dumpTrace(TraceRec *recs, int max);
+int tfs_getStats(OpStats stats[NUM_OPS], int reset);
+int tfs_startDefrag(int budget);
+int tfs_stopDefrag();
+int tfs_startRecord(char *path);
+int tfs_stopRecord();
+
+/* Bodies of the primary functions, called with their locks held */
+fileDescriptor openFileLocked(char *name);
+int mountOptsLocked(char *diskname, int opts);
+int unmountLocked();
+int closeFileLocked(fileDescriptor fd);
+int writeFileLocked(fileDescriptor fd, char *buffer, int size);
+int deleteFileLocked(fileDescriptor fd);
+int readByteLocked(fileDescriptor fd, char *buffer);
+int seekLocked(fileDescriptor fd, int offset);
+int renameLocked(fileDescriptor fd, char *newName);
+int readdirLocked();
+int defragLocked(int size);
+int makeROLocked(char *name);
+int makeRWLocked(char *name);
+int writeByteLocked(fileDescriptor fd, uint8_t data);
+int readLocked(fileDescriptor fd, char *buffer, int size);
+int readvLocked(fileDescriptor fd, struct iovec *iov, int iovcnt);
+int writevLocked(fileDescriptor fd, struct iovec *iov, int iovcnt);
+int pwriteLocked(fileDescriptor fd, char *buffer, int size, int offset);
+int appendLocked(fileDescriptor fd, char *buffer, int size);
+int mapFileLocked(fileDescriptor fd, const char **ptr, int *len);
+fileDescriptor openStreamLocked(char *name);
+int streamWriteLocked(fileDescriptor fd, char *buffer, int size);
+int closeStreamLocked(fileDescriptor fd);
+int beginBatchLocked();
+int commitBatchLocked();
 
 /* Helper Functions */
 int setupFS(int diskFd, int numBlocks);
 int removeInAndFcb(int diskFd, char *filename);
 int getStartBlock(int wrBlockSize, char dMap[], int numBlocks);
+int readSuperBlock(int diskFd, SuperBlock *sBlock);
+int writeSuperBlock(int diskFd, SuperBlock *sBlock);
+int rebuildFS(int diskFd, SuperBlock *sBlock);
+FileEntry *getEntry(fileDescriptor fd);
+FileEntry *nextEntry(FileEntry *fEntry);
+int findInode(int diskFd, char *filename, InodeBlock *iBlock);
+int entryInode(int diskFd, FileEntry *fEntry, InodeBlock *iBlock);
+int writeFileV(fileDescriptor fd, struct iovec *iov, int iovcnt,
+               char *opName);
+int readFileV(fileDescriptor fd, struct iovec *iov, int iovcnt,
+              char *opName);
+int frameBlocks(struct iovec *out, struct iovec *iov, int ctxOff, int size,
+                int room, char *head, int pad);
+int writeAt(fileDescriptor fd, char *buffer, int size, int offset,
+            char *opName);
+int touchATime(int diskFd, FileEntry *fEntry, InodeBlock *iBlock);
+time_t pendingATime(char *filename);
+void applyATime(char *filename, InodeBlock *iBlock);
+int flushATime(int diskFd, char *filename);
+int largestFreeRun(char dMap[], int numBlocks);
+int claimStream(int diskFd, FileEntry *fEntry, int nBlocks);
+int dropStream(int diskFd, FileEntry *fEntry);
+int growFile(int diskFd, InodeBlock *iBlock, int inIdx, int newFcbLen,
+             int zeroTo);
+int submitReq(int op, fileDescriptor fd, char *buffer, int size, int offset,
+              tfsDone done, void *arg);
+void *asyncWorker(void *unused);
+int takeReq();
+int moveFile(int diskFd, int from, int to);
+int planHole(char dMap[], int len[], int numBlocks, int size, int first,
+             int plan[][2], int *nMoves);
+int planSlide(char dMap[], int len[], int numBlocks, int plan[][2],
+              int *nMoves);
+int defragStep();
+void *defragWorker(void *unused);
+OpClock opStart();
+int opEnd(int op, fileDescriptor fd, OpClock start, int res, int bytes);
+int iovBytes(struct iovec *iov, int iovcnt);
+void recordCall(int op, fileDescriptor fd, char *name, int arg, int arg2,
+                OpClock start, int res);
+void writeRecord(CallRec *rec, int64_t startNs, char *name);
+int recordHasName(int op);
+void initLocks();
+void setDMap(int idx, char type, int n);
+void noteBlock(int idx, char type);
+void addCount(int *count, int n);
+void countSpace();
+unsigned seqBegin();
+int seqRetry(unsigned seq);
+void seqWriteBegin();
+void seqWriteEnd();
+void seqLoad(void *dst, const void *src, size_t n);
+void seqStore(void *dst, const void *src, size_t n);
+void indexInode(int idx, InodeBlock *iBlock);
+int writeInode(int diskFd, InodeBlock *iBlock);
+int buildIndex(int diskFd);
+int mapLen();
+char mapAt(int i);
+int indexNamed(int i, char *filename);
+int indexLookup(char *filename, FileInfo *info);
+int stableLookup(char *name, fileDescriptor fd, FileInfo *info);
+int entryName(fileDescriptor fd, char *filename);
+int sameName(fileDescriptor fd, char *filename);
+void setEntry(FileEntry *fEntry, fileDescriptor fd, char *name, int inUse);
+int fileLock(char *name);
+int lockFS(fileDescriptor fd, char *name, int how);
+void unlockFS(int lk, int how);
 #endif /* LIBTINYFS_H*/
\ No newline at end of file
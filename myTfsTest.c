@@ -1,5 +1,15 @@
+#include <sys/wait.h>
+
 #include "libTinyFS.h"
 
+#define FRAG_FILES 8               // files written to the fragmented disk
+#define FRAG_DISK_SIZE 60 * BLOCKSIZE  // bytes of the fragmented disk
+#define STREAM_DISK_SIZE 40 * BLOCKSIZE  // bytes of the stream disk
+#define STREAM_SIZE 2000                 // bytes streamed, spans 9 fcbs
+#define STREAM_CHUNK 300                 // bytes per streamWrite()
+#define CHECK_DISK_SIZE 60 * BLOCKSIZE   // bytes of the disk for checks
+#define CHECK_SIZE 1000                  // bytes of each checked file
+
 /* simple helper function to fill Buffer with as many inPhrase strings as
  * possible before reaching size */
 int fillBufferWithPhrase(char *inPhrase, char *Buffer, int size) {
@@ -15,7 +25,85 @@ int fillBufferWithPhrase(char *inPhrase, char *Buffer, int size) {
     return 0;
 }
 
-int main() {
+/* prints a check as "] part check: what" if ok, "> ..." if not */
+void check(char *part, char *what, int ok) {
+    printf("%c %s check: %s\n", ok ? ']' : '>', part, what);
+}
+
+/* counts the inodes in the disk map on disk, -1 if it can't be read */
+int countInodes(char *diskname) {
+    SuperBlock sBlock;
+    int diskFd = openDisk(diskname, 0);
+    int n = 0;
+
+    if (diskFd < 0 || readBlock(diskFd, 0, &sBlock) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < sBlock.numBlocks; i++) {
+        n += sBlock.dMap[i] == 'I';
+    }
+    closeDisk(diskFd);
+    return n;
+}
+
+/* damages the super block on disk like a crash or a bad write: the
+ * first 'C' block in its map becomes type and its state is set to
+ * state. Returns that block, -1 if there is none */
+int damageDisk(char *diskname, char type, int state) {
+    SuperBlock sBlock;
+    int diskFd = openDisk(diskname, 0);
+    int bNum = -1;
+
+    if (diskFd < 0 || readBlock(diskFd, 0, &sBlock) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < sBlock.numBlocks && bNum < 0; i++) {
+        if (sBlock.dMap[i] == 'C') {
+            bNum = i;
+            sBlock.dMap[i] = type;
+        }
+    }
+    sBlock.state = state;
+    if (bNum >= 0 && writeBlock(diskFd, 0, &sBlock) < 0) {
+        bNum = -1;
+    }
+    closeDisk(diskFd);
+    return bNum;
+}
+
+/* runs the tfsck built next to this program with opts on a disk,
+ * returns its exit status or -1 if it did not exit */
+int runTfsck(char *self, char *opts, char *diskname) {
+    char cmd[256];
+    char *slash = strrchr(self, '/');
+    int status;
+
+    snprintf(cmd, sizeof(cmd), "%.*stfsck %s %s > /dev/null",
+             slash ? (int)(slash - self + 1) : 0, self, opts, diskname);
+    status = system(cmd);
+    return status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* async completion, keeps the result where arg points */
+void keepResult(int req, int res, void *arg) { *(int *)arg = res; }
+
+/* reads a byte of a file through a new fd, returns the fd */
+fileDescriptor readAByte(char *name) {
+    fileDescriptor fd = tfs_openFile(name);
+    char c;
+
+    tfs_read(fd, &c, 1);
+    return fd;
+}
+
+/* access time of a file as on disk, 0 if there is no such file */
+time_t accessTime(char *name) {
+    FileInfo info;
+
+    return tfs_lookup(name, &info) < 0 ? 0 : info.accessTime;
+}
+
+int main(int argc, char *argv[]) {
     char rdBuf;
     char *fileCont1, *fileCont2, *fileCont3, *fileCont4;
     int fileSize1 = 300;   // 2 + inode
@@ -29,6 +117,47 @@ int main() {
 
     fileDescriptor fd1, fd2, fd3, fd4;
 
+    fileDescriptor fragFd[FRAG_FILES];
+    char fragCont[FRAG_FILES][1400];
+    char fragBuf[1400];
+    char fragName[9];
+    int fragSize[FRAG_FILES];
+    FileInfo fragInfo;
+    SpaceStats fragStats;
+    OpStats recStats[NUM_OPS];
+    long recCalls = 0;
+    fileDescriptor strmFd;
+    char strmCont[STREAM_SIZE];
+    char strmBuf[STREAM_SIZE];
+    FileInfo strmInfo;
+    SpaceStats strmStats;
+    int strmFree;
+    fileDescriptor chkFd;
+    char chkCont[CHECK_SIZE];
+    char chkBuf[CHECK_SIZE];
+    struct iovec chkIov[3];
+    FileInfo chkInfo;
+    const char *chkPtr;
+    int chkLen;
+    fileDescriptor batchFd[3];
+    int batchInodes;
+    int asyncPipe;
+    int asyncReq;
+    int asyncDone;
+    int asyncRes;
+    time_t atimeWas[4];
+    OpStats chkStats[NUM_OPS];
+    SpaceStats chkSpace;
+    SpaceStats chkSpaceWas;
+    TraceRec traceRecs[8];
+    int traceOps[6] = {OP_MOUNT, OP_OPEN, OP_WRITE, OP_SEEK, OP_READ, OP_CLOSE};
+    int traceOk;
+    uint64_t latCalls;
+    int i;
+
+    /* print what each call did */
+    tfs_setLogLevel(TFS_LOG_INFO);
+
     fileCont1 = (char *)malloc(fileSize1 * sizeof(char));
     if (fillBufferWithPhrase(filePhrase1, fileCont1, fileSize1) < 0) {
         perror("failed");
@@ -211,6 +340,418 @@ int main() {
         tfs_closeFile(fd4);
     }
 
+    /************** Testing Defrag With Open Files **************/
+    /* Close what the demo left open, the recording starts without fds */
+    tfs_closeFile(fd1);
+    tfs_closeFile(fd2);
+    tfs_closeFile(fd3);
+    tfs_closeFile(fd4);
+
+    /* fresh disk every run, so the layout is the same each time */
+    tfs_mkfs("tinyFSDiskFrag", FRAG_DISK_SIZE);
+    tfs_mount("tinyFSDiskFrag");
+
+    /* Record this part for make runReplay, stats count the same calls */
+    tfs_startRecord("tinyFSDiskFrag.rec");
+    tfs_getStats(recStats, 1);
+
+    /* Write files of different sizes, keeping every fd open */
+    for (i = 0; i < FRAG_FILES; i++) {
+        snprintf(fragName, sizeof(fragName), "frag%d", i);
+        fragSize[i] = 200 + i * 150;
+        memset(fragCont[i], 'a' + i, fragSize[i]);
+        fragFd[i] = tfs_openFile(fragName);
+        tfs_writeFile(fragFd[i], fragCont[i], fragSize[i]);
+    }
+
+    /* Delete every other file to leave holes between the rest */
+    for (i = 0; i < FRAG_FILES; i += 2) {
+        tfs_deleteFile(fragFd[i]);
+        fragFd[i] = -1;
+    }
+
+    /* Change the rest in place and at their end */
+    for (i = 1; i < FRAG_FILES; i += 2) {
+        tfs_pwrite(fragFd[i], "PW", 2, 10);
+        memcpy(fragCont[i] + 10, "PW", 2);
+        tfs_append(fragFd[i], "APPEND", 6);
+        memcpy(fragCont[i] + fragSize[i], "APPEND", 6);
+        fragSize[i] += 6;
+    }
+    tfs_displayFragments();
+
+    /* Make room for one large file, then compact the whole disk */
+    tfs_defragFor(30);
+    tfs_displayFragments();
+    tfs_defrag();
+    tfs_displayFragments();
+
+    /* Read every file back through the fd opened before it moved */
+    for (i = 1; i < FRAG_FILES; i += 2) {
+        snprintf(fragName, sizeof(fragName), "frag%d", i);
+        tfs_seek(fragFd[i], 0);
+        if (tfs_read(fragFd[i], fragBuf, sizeof(fragBuf)) != fragSize[i] ||
+            memcmp(fragBuf, fragCont[i], fragSize[i]) != 0) {
+            printf("> Defrag check: '%s' differs after defrag\n", fragName);
+        } else if (tfs_lookup(fragName, &fragInfo) < 0 ||
+                   fragInfo.fSize != fragSize[i]) {
+            printf("> Defrag check: lookup of '%s' failed\n", fragName);
+        } else {
+            printf("] Defrag check: '%s' read back %d bytes\n", fragName,
+                   fragSize[i]);
+        }
+        tfs_closeFile(fragFd[i]);
+    }
+
+    /* No holes left */
+    tfs_getSpaceStats(&fragStats);
+    printf("] Defrag check: %d free blocks, largest free run %d\n",
+           fragStats.numFree, fragStats.largestFree);
+    tfs_unmount();
+    tfs_getStats(recStats, 0);
+    for (i = 0; i < NUM_OPS; i++) {
+        recCalls += recStats[i].calls;
+    }
+    if (tfs_stopRecord() < 0) {
+        printf("> Record check: recording failed\n");
+    } else {
+        printf("] Record check: recorded %ld calls\n", recCalls);
+    }
+
+    /************** Testing Streams **************/
+    tfs_mkfs("tinyFSDiskStream", STREAM_DISK_SIZE);
+    tfs_mount("tinyFSDiskStream");
+    for (i = 0; i < STREAM_SIZE; i++) {
+        strmCont[i] = 'a' + i % 26;
+    }
+
+    /* Stream in chunks that end mid block, then read the file back */
+    strmFd = tfs_openStream("stream1");
+    for (i = 0; i < STREAM_SIZE; i += STREAM_CHUNK) {
+        tfs_streamWrite(strmFd, strmCont + i, STREAM_SIZE - i < STREAM_CHUNK
+                                                  ? STREAM_SIZE - i
+                                                  : STREAM_CHUNK);
+    }
+    if (tfs_closeStream(strmFd) < 0) {
+        printf("> Stream check: closeStream() failed\n");
+    }
+    strmFd = tfs_openFile("stream1");
+    memset(strmBuf, 0, sizeof(strmBuf));
+    if (tfs_read(strmFd, strmBuf, sizeof(strmBuf)) != STREAM_SIZE ||
+        memcmp(strmBuf, strmCont, STREAM_SIZE) != 0) {
+        printf("> Stream check: 'stream1' differs after close\n");
+    } else {
+        printf("] Stream check: 'stream1' read back %d bytes\n", STREAM_SIZE);
+    }
+    tfs_closeFile(strmFd);
+
+    /* Unmount drops an open stream, its blocks come back */
+    tfs_getSpaceStats(&strmStats);
+    strmFree = strmStats.numFree;
+    strmFd = tfs_openStream("stream2");
+    tfs_streamWrite(strmFd, strmCont, STREAM_SIZE);
+    tfs_unmount();
+    tfs_mount("tinyFSDiskStream");
+    tfs_getSpaceStats(&strmStats);
+    if (tfs_lookup("stream2", &strmInfo) == 0 ||
+        strmStats.numFree != strmFree) {
+        printf("> Stream check: unmount kept the dropped stream\n");
+    }
+
+    /* Stream the same name again on the new mount */
+    strmFd = tfs_openStream("stream2");
+    tfs_streamWrite(strmFd, strmCont + 1, STREAM_SIZE - 1);
+    tfs_closeStream(strmFd);
+    strmFd = tfs_openFile("stream2");
+    memset(strmBuf, 0, sizeof(strmBuf));
+    if (tfs_read(strmFd, strmBuf, sizeof(strmBuf)) != STREAM_SIZE - 1 ||
+        memcmp(strmBuf, strmCont + 1, STREAM_SIZE - 1) != 0) {
+        printf("> Stream check: 'stream2' differs after remount\n");
+    } else {
+        printf("] Stream check: 'stream2' read back %d bytes after remount\n",
+               STREAM_SIZE - 1);
+    }
+    tfs_closeFile(strmFd);
+    tfs_unmount();
+
+    /************** Testing Raw Data Layout **************/
+    for (i = 0; i < CHECK_SIZE; i++) {
+        chkCont[i] = 'A' + i % 26;
+    }
+    tfs_mkfs("tinyFSDiskCheck", CHECK_DISK_SIZE);
+    tfs_mountOpts("tinyFSDiskCheck", TFS_RAWDATA);
+    chkFd = tfs_openFile("raw");
+    tfs_writeFile(chkFd, chkCont, CHECK_SIZE);
+
+    /* Bulk reads move the file pointer and stop at the end */
+    memset(chkBuf, 0, sizeof(chkBuf));
+    check("Raw", "read() returns the first 300 bytes",
+          tfs_read(chkFd, chkBuf, 300) == 300);
+    check("Raw", "read() returns the rest",
+          tfs_read(chkFd, chkBuf + 300, CHECK_SIZE) == CHECK_SIZE - 300 &&
+              memcmp(chkBuf, chkCont, CHECK_SIZE) == 0);
+    check("Raw", "read() returns 0 at the end",
+          tfs_read(chkFd, chkBuf, 1) == 0);
+
+    /* Scatter the file into segments, then gather halves swapped */
+    tfs_seek(chkFd, 0);
+    memset(chkBuf, 0, sizeof(chkBuf));
+    chkIov[0].iov_base = chkBuf;
+    chkIov[0].iov_len = 100;
+    chkIov[1].iov_base = chkBuf + 100;
+    chkIov[1].iov_len = 400;
+    chkIov[2].iov_base = chkBuf + 500;
+    chkIov[2].iov_len = CHECK_SIZE - 500;
+    check("Raw", "readv() fills 3 segments",
+          tfs_readv(chkFd, chkIov, 3) == CHECK_SIZE &&
+              memcmp(chkBuf, chkCont, CHECK_SIZE) == 0);
+    chkIov[0].iov_base = chkCont + 500;
+    chkIov[0].iov_len = CHECK_SIZE - 500;
+    chkIov[1].iov_base = chkCont;
+    chkIov[1].iov_len = 500;
+    tfs_writev(chkFd, chkIov, 2);
+    tfs_seek(chkFd, 0);
+    memset(chkBuf, 0, sizeof(chkBuf));
+    check("Raw", "writev() joins 2 segments",
+          tfs_read(chkFd, chkBuf, CHECK_SIZE) == CHECK_SIZE &&
+              memcmp(chkBuf, chkCont + 500, CHECK_SIZE - 500) == 0 &&
+              memcmp(chkBuf + CHECK_SIZE - 500, chkCont, 500) == 0);
+
+    /* The content is one run on disk, mapped without a copy */
+    check("Raw", "lookup() shows the raw layout",
+          tfs_lookup("raw", &chkInfo) == 0 && chkInfo.layout == LAYOUT_RAW);
+    check("Raw", "mapFile() maps the whole file",
+          tfs_mapFile(chkFd, &chkPtr, &chkLen) == 0 &&
+              chkLen == CHECK_SIZE &&
+              memcmp(chkPtr, chkBuf, CHECK_SIZE) == 0);
+    tfs_closeFile(chkFd);
+
+    /* The layout stays with the file, new files are framed again */
+    tfs_mount("tinyFSDiskCheck");
+    chkFd = tfs_openFile("raw");
+    check("Raw", "mapFile() maps it after a plain mount",
+          tfs_mapFile(chkFd, &chkPtr, &chkLen) == 0 &&
+              chkLen == CHECK_SIZE &&
+              memcmp(chkPtr, chkBuf, CHECK_SIZE) == 0);
+    tfs_closeFile(chkFd);
+    chkFd = tfs_openFile("framed");
+    tfs_writeFile(chkFd, chkCont, CHECK_SIZE);
+    check("Raw", "mapFile() refuses a framed file",
+          tfs_mapFile(chkFd, &chkPtr, &chkLen) < 0);
+    tfs_closeFile(chkFd);
+
+    /************** Testing Batches **************/
+    /* Files written in a batch stay in memory but can be read back */
+    batchInodes = countInodes("tinyFSDiskCheck");
+    tfs_beginBatch();
+    for (i = 0; i < 3; i++) {
+        snprintf(fragName, sizeof(fragName), "batch%d", i);
+        batchFd[i] = tfs_openFile(fragName);
+        tfs_writeFile(batchFd[i], chkCont + i, CHECK_SIZE - i);
+    }
+    tfs_seek(batchFd[1], 0);
+    memset(chkBuf, 0, sizeof(chkBuf));
+    check("Batch", "reads see uncommitted writes",
+          tfs_read(batchFd[1], chkBuf, CHECK_SIZE) == CHECK_SIZE - 1 &&
+              memcmp(chkBuf, chkCont + 1, CHECK_SIZE - 1) == 0);
+    check("Batch", "disk is unchanged before the commit",
+          countInodes("tinyFSDiskCheck") == batchInodes);
+    check("Batch", "commitBatch() succeeds", tfs_commitBatch() == 0);
+    check("Batch", "commit writes the 3 inodes",
+          countInodes("tinyFSDiskCheck") == batchInodes + 3);
+    for (i = 0; i < 3; i++) {
+        tfs_closeFile(batchFd[i]);
+    }
+
+    /* Committed content survives a remount */
+    tfs_mount("tinyFSDiskCheck");
+    for (i = 0; i < 3; i++) {
+        snprintf(fragName, sizeof(fragName), "batch%d", i);
+        batchFd[i] = tfs_openFile(fragName);
+        memset(chkBuf, 0, sizeof(chkBuf));
+        if (tfs_read(batchFd[i], chkBuf, CHECK_SIZE) != CHECK_SIZE - i ||
+            memcmp(chkBuf, chkCont + i, CHECK_SIZE - i) != 0) {
+            printf("> Batch check: '%s' differs after remount\n", fragName);
+        } else {
+            printf("] Batch check: '%s' read back %d bytes\n", fragName,
+                   CHECK_SIZE - i);
+        }
+        tfs_closeFile(batchFd[i]);
+    }
+
+    /************** Testing Async Requests **************/
+    chkFd = tfs_openFile("async");
+    asyncPipe = tfs_startAsync();
+    /* Requests without a callback post their handle to the pipe */
+    asyncReq = tfs_awriteFile(chkFd, chkCont, CHECK_SIZE, NULL, NULL);
+    check("Async", "the pipe posts the awriteFile() handle",
+          read(asyncPipe, &asyncDone, sizeof(asyncDone)) ==
+                  sizeof(asyncDone) &&
+              asyncDone == asyncReq);
+    check("Async", "reap() returns the writeFile() result",
+          tfs_reap(asyncReq) >= 0);
+    asyncReq = tfs_apwrite(chkFd, "ASYNC", 5, 10, NULL, NULL);
+    check("Async", "reap() waits for the pwrite() result",
+          tfs_reap(asyncReq) >= 0);
+    check("Async", "the pipe posts the apwrite() handle",
+          read(asyncPipe, &asyncDone, sizeof(asyncDone)) ==
+                  sizeof(asyncDone) &&
+              asyncDone == asyncReq);
+
+    /* A callback gets the result, stopAsync() waits for it */
+    asyncRes = -1;
+    memset(chkBuf, 0, sizeof(chkBuf));
+    tfs_aread(chkFd, chkBuf, CHECK_SIZE, keepResult, &asyncRes);
+    tfs_stopAsync();
+    check("Async", "aread() passes its result to the callback",
+          asyncRes == CHECK_SIZE && memcmp(chkBuf, chkCont, 10) == 0 &&
+              memcmp(chkBuf + 10, "ASYNC", 5) == 0 &&
+              memcmp(chkBuf + 15, chkCont + 15, CHECK_SIZE - 15) == 0);
+    tfs_closeFile(chkFd);
+
+    /************** Testing Access Time Options **************/
+    /* Written files start with access time equal to modification time */
+    for (i = 0; i < 4; i++) {
+        snprintf(fragName, sizeof(fragName), "atime%d", i);
+        chkFd = tfs_openFile(fragName);
+        tfs_writeFile(chkFd, chkCont, 10);
+        tfs_closeFile(chkFd);
+        atimeWas[i] = accessTime(fragName);
+    }
+    sleep(1);
+
+    /* A plain mount moves it on every read */
+    tfs_closeFile(readAByte("atime0"));
+    check("Atime", "a plain mount moves it on a read",
+          accessTime("atime0") > atimeWas[0]);
+
+    /* Noatime never moves it */
+    tfs_mountOpts("tinyFSDiskCheck", TFS_NOATIME);
+    tfs_closeFile(readAByte("atime1"));
+    check("Atime", "noatime keeps it", accessTime("atime1") == atimeWas[1]);
+
+    /* Relatime moves it while it is not newer than the modification */
+    tfs_mountOpts("tinyFSDiskCheck", TFS_RELATIME);
+    tfs_closeFile(readAByte("atime2"));
+    check("Atime", "relatime moves it once",
+          accessTime("atime2") > atimeWas[2]);
+    atimeWas[2] = accessTime("atime2");
+
+    /* Lazytime keeps it in the OFT until the file is closed */
+    tfs_mountOpts("tinyFSDiskCheck", TFS_LAZYTIME);
+    chkFd = readAByte("atime3");
+    check("Atime", "lazytime holds it while the file is open",
+          accessTime("atime3") == atimeWas[3]);
+    tfs_closeFile(chkFd);
+    check("Atime", "lazytime writes it on close",
+          accessTime("atime3") > atimeWas[3]);
+
+    /* Newer than the modification, relatime leaves it for a day */
+    sleep(1);
+    tfs_mountOpts("tinyFSDiskCheck", TFS_RELATIME);
+    tfs_closeFile(readAByte("atime2"));
+    check("Atime", "relatime then keeps it",
+          accessTime("atime2") == atimeWas[2]);
+    tfs_unmount();
+
+    /************** Testing Clean Mounts **************/
+    /* After a clean unmount the map is trusted, only inodes are read */
+    tfs_getStats(chkStats, 1);
+    tfs_mount("tinyFSDiskCheck");
+    tfs_getStats(chkStats, 1);
+    tfs_getSpaceStats(&chkSpaceWas);
+    check("Mount", "a clean mount reads the super block and inodes",
+          chkStats[OP_MOUNT].blocksRead == 1 + chkSpaceWas.numFiles);
+    tfs_unmount();
+
+    /* A dirty disk is rebuilt from every block, fixing its map */
+    check("Mount", "a block is freed in the map of a dirty disk",
+          damageDisk("tinyFSDiskCheck", 'F', SB_DIRTY) >= 0);
+    tfs_getStats(chkStats, 1);
+    tfs_mount("tinyFSDiskCheck");
+    tfs_getStats(chkStats, 1);
+    tfs_getSpaceStats(&chkSpace);
+    check("Mount", "a dirty mount reads every block",
+          chkStats[OP_MOUNT].blocksRead > chkSpace.numBlocks);
+    check("Mount", "the rebuild restores the map",
+          chkSpace.numFree == chkSpaceWas.numFree &&
+              chkSpace.numFiles == chkSpaceWas.numFiles);
+    chkFd = tfs_openFile("batch1");
+    memset(chkBuf, 0, sizeof(chkBuf));
+    check("Mount", "files read back after the rebuild",
+          tfs_read(chkFd, chkBuf, CHECK_SIZE) == CHECK_SIZE - 1 &&
+              memcmp(chkBuf, chkCont + 1, CHECK_SIZE - 1) == 0);
+    tfs_closeFile(chkFd);
+    tfs_unmount();
+
+    /************** Testing tfsck **************/
+    check("Tfsck", "a clean disk has no problems",
+          runTfsck(argv[0], "", "tinyFSDiskCheck") == 0);
+
+    /* A map that disagrees with the blocks is found and repaired */
+    damageDisk("tinyFSDiskCheck", 'F', SB_CLEAN);
+    check("Tfsck", "a bad map is found",
+          runTfsck(argv[0], "", "tinyFSDiskCheck") == 4);
+    check("Tfsck", "-r repairs it",
+          runTfsck(argv[0], "-r", "tinyFSDiskCheck") == 1);
+    check("Tfsck", "the repaired disk has no problems",
+          runTfsck(argv[0], "", "tinyFSDiskCheck") == 0);
+    tfs_mount("tinyFSDiskCheck");
+    tfs_getSpaceStats(&chkSpace);
+    check("Tfsck", "the repair keeps every file",
+          chkSpace.numFree == chkSpaceWas.numFree &&
+              chkSpace.numFiles == chkSpaceWas.numFiles);
+    tfs_unmount();
+
+    /************** Testing Trace Ring **************/
+    /* Only calls made while tracing is on are kept, oldest first */
+    tfs_setTrace(1);
+    tfs_mount("tinyFSDiskCheck");
+    chkFd = tfs_openFile("trace");
+    tfs_writeFile(chkFd, chkCont, CHECK_SIZE);
+    tfs_seek(chkFd, 0);
+    tfs_read(chkFd, chkBuf, CHECK_SIZE);
+    tfs_closeFile(chkFd);
+    tfs_setTrace(0);
+    check("Trace", "dumpTrace() returns the 6 traced calls",
+          tfs_dumpTrace(traceRecs, 8) == 6);
+    traceOk = traceRecs[1].res == chkFd;
+    for (i = 0; i < 6; i++) {
+        traceOk = traceOk && traceRecs[i].op == traceOps[i] &&
+                  traceRecs[i].seq == traceRecs[0].seq + i &&
+                  (i == 0 || traceRecs[i].fd == chkFd);
+    }
+    check("Trace", "records hold the calls in order", traceOk);
+    check("Trace", "the read records its result and the inode",
+          traceRecs[4].res == CHECK_SIZE && traceRecs[4].block > 0);
+
+    /************** Testing Statistics **************/
+    /* A read, and a read on a closed fd that fails */
+    tfs_getStats(chkStats, 1);
+    chkFd = tfs_openFile("trace");
+    tfs_read(chkFd, chkBuf, CHECK_SIZE);
+    tfs_closeFile(chkFd);
+    tfs_read(chkFd, chkBuf, CHECK_SIZE);
+    tfs_getStats(chkStats, 0);
+    latCalls = 0;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        latCalls += chkStats[OP_READ].latency[i];
+    }
+    check("Stats", "getStats() counts both reads and the error",
+          chkStats[OP_READ].calls == 2 && chkStats[OP_READ].errors == 1 &&
+              chkStats[OP_OPEN].calls == 1 && chkStats[OP_CLOSE].calls == 1);
+    check("Stats", "the read's bytes, blocks and access time are counted",
+          chkStats[OP_READ].bytes == CHECK_SIZE &&
+              chkStats[OP_READ].blocksRead >=
+                  (CHECK_SIZE + BLOCKDATA - 1) / BLOCKDATA &&
+              chkStats[OP_READ].blocksWritten == 1);
+    check("Stats", "every read has a latency bucket", latCalls == 2);
+    tfs_getStats(chkStats, 1);
+    tfs_getStats(chkStats, 0);
+    check("Stats", "a reset starts the counters again",
+          chkStats[OP_READ].calls == 0 && chkStats[OP_READ].bytes == 0);
+    tfs_unmount();
+
     /************** Clean Up **************/
     free(fileCont1);
     free(fileCont2);
@@ -0,0 +1,276 @@
+/* TinyFS workload replayer
+ *
+ * Replays calls recorded with tfs_startRecord() against a fresh disk. The
+ * disk is made with the recorded disk's size, files that were on it when
+ * recording started are written with their recorded size, and then every
+ * call is made again in the order it was recorded, from one thread. Written
+ * content is filler, as recordings hold no data. Recorded fds are mapped
+ * to the fds the replay gets back. Calls run back to back unless -t keeps
+ * the recorded gaps between their starts. Prints the calls whose result
+ * differs from the recording and per operation statistics.
+ *
+ * Usage: replay [-t] [-o opts] trace diskname
+ *   -t  keep the recorded timing between calls (default full speed)
+ *   -o  mount options to use instead of the recorded ones
+ *
+ * Exit status: 0 every result matched, 4 results differed, 8 failure
+ */
+
+#include <unistd.h>
+
+#include "libTinyFS.h"
+
+#define MAX_IO 65536  // bytes of filler, the largest file content
+
+// Names of OP_* for the statistics
+char *opNames[NUM_OPS] = {
+    "open",       "mount",       "unmount",     "close",
+    "writeFile",  "delete",      "readByte",    "seek",
+    "rename",     "readdir",     "defrag",      "makeRO",
+    "makeRW",     "writeByte",   "read",        "readv",
+    "writev",     "pwrite",      "append",      "mapFile",
+    "openStream", "streamWrite", "closeStream", "beginBatch",
+    "commitBatch"};
+
+// Recorded fd and the fd it got in the replay, by OFT slot
+typedef struct FdMap {
+    fileDescriptor recFd;
+    fileDescriptor fd;
+} FdMap;
+
+FdMap mFdMap[MAX_OPEN];  // recorded fds open in the replay
+char mFiller[MAX_IO];    // content of every write, target of reads
+
+/*
+ * Returns the replay's fd for a recorded fd, -1 if it was never opened
+ */
+fileDescriptor mapFd(fileDescriptor recFd) {
+    FdMap *m = &mFdMap[(unsigned)recFd % MAX_OPEN];
+
+    return recFd >= 0 && m->recFd == recFd ? m->fd : -1;
+}
+
+void setFd(fileDescriptor recFd, fileDescriptor fd) {
+    if (recFd >= 0) {
+        mFdMap[(unsigned)recFd % MAX_OPEN].recFd = recFd;
+        mFdMap[(unsigned)recFd % MAX_OPEN].fd = fd;
+    }
+}
+
+/*
+ * Forgets a recorded fd once the recording shows it was closed
+ */
+void dropFd(CallRec *rec) {
+    if (rec->res >= 0 && mapFd(rec->fd) >= 0) {
+        mFdMap[(unsigned)rec->fd % MAX_OPEN].recFd = -1;
+    }
+}
+
+/*
+ * Writes a file that was on disk when recording started
+ */
+int makeFile(char *name, int size, int rdOnly) {
+    fileDescriptor fd = tfs_openFile(name);
+    int res = tfs_writeFile(fd, mFiller, size);
+
+    tfs_closeFile(fd);
+    if (res >= 0 && rdOnly) {
+        res = tfs_makeRO(name);
+    }
+    return res;
+}
+
+/*
+ * Makes one recorded call. Returns its result
+ */
+int replayCall(CallRec *rec, char *name, char *diskname, int opts) {
+    fileDescriptor fd = mapFd(rec->fd);
+    int size = rec->arg < 0 ? 0 : rec->arg > MAX_IO ? MAX_IO : rec->arg;
+    struct iovec iov[rec->arg2 > 0 && rec->arg2 <= IOV_MAX ? rec->arg2 : 1];
+    int iovcnt = sizeof(iov) / sizeof(iov[0]);
+    const char *ptr;
+    int len;
+    int res;
+
+    switch (rec->op) {
+        case REC_FILE:
+            return makeFile(name, size, rec->arg2);
+        case OP_OPEN:
+            res = tfs_openFile(name);
+            setFd(rec->res, res);
+            return res;
+        case OP_MOUNT:
+            memset(mFdMap, 0xff, sizeof(mFdMap));
+            return tfs_mountOpts(diskname, opts >= 0 ? opts : rec->arg);
+        case OP_UNMOUNT:
+            memset(mFdMap, 0xff, sizeof(mFdMap));
+            return tfs_unmount();
+        case OP_CLOSE:
+            dropFd(rec);
+            return tfs_closeFile(fd);
+        case OP_WRITE:
+            return tfs_writeFile(fd, mFiller, size);
+        case OP_DELETE:
+            dropFd(rec);
+            return tfs_deleteFile(fd);
+        case OP_READBYTE:
+            return tfs_readByte(fd, mFiller);
+        case OP_SEEK:
+            return tfs_seek(fd, rec->arg);
+        case OP_RENAME:
+            return tfs_rename(fd, name);
+        case OP_READDIR:
+            return tfs_readdir();
+        case OP_DEFRAG:
+            return rec->arg < 0 ? tfs_defrag() : tfs_defragFor(rec->arg);
+        case OP_MAKERO:
+            return tfs_makeRO(name);
+        case OP_MAKERW:
+            return tfs_makeRW(name);
+        case OP_WRITEBYTE:
+            return tfs_writeByte(fd, 0);
+        case OP_READ:
+            return tfs_read(fd, mFiller, size);
+        case OP_READV:
+        case OP_WRITEV:
+            // recorded size split evenly over the recorded segments
+            for (int i = 0; i < iovcnt; i++) {
+                iov[i].iov_base = mFiller + size / iovcnt * i;
+                iov[i].iov_len = size / iovcnt + (i == iovcnt - 1) *
+                                                      (size % iovcnt);
+            }
+            return rec->op == OP_READV ? tfs_readv(fd, iov, iovcnt)
+                                       : tfs_writev(fd, iov, iovcnt);
+        case OP_PWRITE:
+            return tfs_pwrite(fd, mFiller, size, rec->arg2);
+        case OP_APPEND:
+            return tfs_append(fd, mFiller, size);
+        case OP_MAPFILE:
+            return tfs_mapFile(fd, &ptr, &len);
+        case OP_OPENSTREAM:
+            res = tfs_openStream(name);
+            setFd(rec->res, res);
+            return res;
+        case OP_STREAMWRITE:
+            return tfs_streamWrite(fd, mFiller, size);
+        case OP_CLOSESTREAM:
+            dropFd(rec);
+            return tfs_closeStream(fd);
+        case OP_BEGINBATCH:
+            return tfs_beginBatch();
+        case OP_COMMITBATCH:
+            return tfs_commitBatch();
+    }
+    return -1;
+}
+
+/*
+ * Returns whether a replayed result matches the recorded one. Fds
+ * differ between runs, so opens only need to agree on success
+ */
+int sameResult(CallRec *rec, int res) {
+    if (rec->op == OP_OPEN || rec->op == OP_OPENSTREAM ||
+        rec->op == REC_FILE) {
+        return (rec->res < 0) == (res < 0);
+    }
+    return rec->res == res;
+}
+
+int main(int argc, char *argv[]) {
+    RecordHead head;
+    CallRec rec;
+    OpStats stats[NUM_OPS];
+    struct timespec gap;
+    char name[9];
+    int timing = 0;
+    int opts = -1;
+    int opt;
+    long calls = 0;
+    long differ = 0;
+
+    while ((opt = getopt(argc, argv, "to:")) != -1) {
+        if (opt == 't') {
+            timing = 1;
+        } else if (opt == 'o') {
+            opts = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-t] [-o opts] trace diskname\n",
+                    argv[0]);
+            return 8;
+        }
+    }
+    if (optind + 2 != argc) {
+        fprintf(stderr, "usage: %s [-t] [-o opts] trace diskname\n", argv[0]);
+        return 8;
+    }
+    char *diskname = argv[optind + 1];
+
+    /* Check recording */
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL || fread(&head, sizeof(head), 1, file) != 1 ||
+        memcmp(head.magic, RECORD_MAGIC, sizeof(head.magic)) != 0 ||
+        head.version != RECORD_VERSION) {
+        fprintf(stderr, "replay: '%s' is not a recording\n", argv[optind]);
+        return 8;
+    }
+
+    /* Fresh disk, mounted if the recording started mounted */
+    memset(mFdMap, 0xff, sizeof(mFdMap));
+    memset(mFiller, 'r', sizeof(mFiller));
+    int numBlocks = head.numBlocks > 0 ? head.numBlocks : DMAP_SIZE;
+    if (tfs_mkfs(diskname, numBlocks * BLOCKSIZE) < 0 ||
+        (head.numBlocks > 0 &&
+         tfs_mountOpts(diskname, opts >= 0 ? opts : head.opts) < 0)) {
+        fprintf(stderr, "replay: cannot make disk '%s'\n", diskname);
+        return 8;
+    }
+    tfs_getStats(stats, 1);
+
+    /* Calls */
+    int64_t begin = opStart().startNs;
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        memset(name, 0, sizeof(name));
+        int named = recordHasName(rec.op);
+        if (rec.op > REC_FILE ||
+            (named && fread(name, sizeof(name), 1, file) != 1)) {
+            fprintf(stderr, "replay: bad record after %ld calls\n", calls);
+            break;
+        }
+        name[sizeof(name) - 1] = '\0';
+        if (timing && rec.gapUs > 0) {
+            gap.tv_sec = rec.gapUs / 1000000;
+            gap.tv_nsec = rec.gapUs % 1000000 * 1000;
+            nanosleep(&gap, NULL);
+        }
+
+        int res = replayCall(&rec, name, diskname, opts);
+        calls++;
+        if (!sameResult(&rec, res)) {
+            differ++;
+            printf("call %ld: %s returned %d, recorded %d\n", calls,
+                   rec.op == REC_FILE ? "file" : opNames[rec.op], res,
+                   rec.res);
+        }
+    }
+    int64_t elapsed = opStart().startNs - begin;
+    fclose(file);
+
+    /* Statistics */
+    tfs_getStats(stats, 0);
+    printf("Replayed %ld calls in %.3f ms, %ld results differed\n", calls,
+           elapsed / 1e6, differ);
+    for (int op = 0; op < NUM_OPS; op++) {
+        OpStats *st = &stats[op];
+        if (st->calls == 0) {
+            continue;
+        }
+        printf("%-12s %8llu calls %6llu errors %8.2f blocks read %8.2f "
+               "written per call\n",
+               opNames[op], (unsigned long long)st->calls,
+               (unsigned long long)st->errors,
+               (double)st->blocksRead / st->calls,
+               (double)st->blocksWritten / st->calls);
+    }
+    tfs_unmount();
+    return differ > 0 ? 4 : 0;
+}
@@ -0,0 +1,207 @@
+/* TinyFS stress test
+ *
+ * Runs threads against one mounted disk and checks what they read back.
+ * Writers rewrite their own file and read it back, readers read a shared
+ * file that never changes, a looker looks the shared file and the free
+ * space up without locks, and a renamer renames its file back and forth
+ * and then defragments the disk under them. Then the disk is mounted with
+ * write-back and writers pwrite a range of their file and read it back
+ * while the flusher writes blocks behind them. Built with ThreadSanitizer
+ * by `make stress`, run by `make runStress`.
+ *
+ * Exit status: 0 no errors, 1 errors
+ */
+
+#include "libTinyFS.h"
+
+#define NUM_THREADS 8     // writers, and as many readers
+#define WRITE_ROUNDS 200  // rewrites per writer
+#define READ_ROUNDS 2000  // reads of the shared file per reader
+#define SHARED_SIZE 300   // bytes of the shared file
+#define BACK_ROUNDS 5000  // pwrites per writer on the write-back mount
+#define BACK_SIZE 1000    // bytes of each write-back writer's file
+
+int errors = 0;
+
+/*
+ * Counts an error and prints what went wrong
+ */
+void fail(char *what, long thread, int round, int res) {
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    printf("> %s: thread %ld round %d returned %d\n", what, thread, round,
+           res);
+}
+
+/*
+ * Rewrites its own file with a size and fill that change every round
+ * and reads the whole file back
+ */
+void *writer(void *arg) {
+    long t = (long)arg;
+    char name[9];
+    char buf[600];
+    char rdBuf[600];
+
+    snprintf(name, sizeof(name), "w%ld", t);
+    fileDescriptor fd = tfs_openFile(name);
+    for (int i = 0; i < WRITE_ROUNDS; i++) {
+        int n = 50 + (i * 37 + t * 11) % 500;
+
+        memset(buf, 'a' + (i + t) % 26, n);
+        int res = tfs_writeFile(fd, buf, n);
+        if (res < 0) {
+            fail("writeFile", t, i, res);
+            continue;
+        }
+        tfs_seek(fd, 0);
+        res = tfs_read(fd, rdBuf, sizeof(rdBuf));
+        if (res != n || memcmp(rdBuf, buf, n) != 0) {
+            fail("read after writeFile", t, i, res);
+        }
+        if (i % 50 == 0) {
+            tfs_pwrite(fd, "QQ", 2, 3);
+        }
+    }
+    tfs_closeFile(fd);
+    return NULL;
+}
+
+/*
+ * Reads the shared file from the start over and over
+ */
+void *reader(void *arg) {
+    long t = (long)arg;
+    char rdBuf[600];
+
+    fileDescriptor fd = tfs_openFile("shared");
+    for (int i = 0; i < READ_ROUNDS; i++) {
+        tfs_seek(fd, 0);
+        int res = tfs_read(fd, rdBuf, sizeof(rdBuf));
+        if (res != SHARED_SIZE || rdBuf[0] != 's' ||
+            rdBuf[SHARED_SIZE - 1] != 's') {
+            fail("read shared", t, i, res);
+        }
+    }
+    tfs_closeFile(fd);
+    return NULL;
+}
+
+/*
+ * Looks the shared file and the space statistics up without locks
+ * while the others write and move files
+ */
+void *looker(void *arg) {
+    FileInfo info;
+    SpaceStats stats;
+
+    for (int i = 0; i < READ_ROUNDS; i++) {
+        int res = tfs_lookup("shared", &info);
+        if (res < 0 || info.fSize != SHARED_SIZE) {
+            fail("lookup shared", -1, i, res);
+        }
+        res = tfs_getSpaceStats(&stats);
+        if (res < 0 || stats.numFree > stats.numBlocks ||
+            stats.largestFree > stats.numFree) {
+            fail("space stats", -1, i, res);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Renames its file back and forth, then defragments the disk
+ */
+void *renamer(void *arg) {
+    char name[9];
+    int res;
+
+    fileDescriptor fd = tfs_openFile("rn");
+    tfs_writeFile(fd, "x", 1);
+    for (int i = 0; i < WRITE_ROUNDS; i++) {
+        snprintf(name, sizeof(name), "rn%d", i % 2);
+        if ((res = tfs_rename(fd, name)) < 0) {
+            fail("rename", -1, i, res);
+        }
+    }
+    if ((res = tfs_defrag()) < 0) {
+        fail("defrag", -1, 0, res);
+    }
+    return NULL;
+}
+
+/*
+ * Pwrites a range of its own file with a fill that changes every round
+ * and reads the range back, on a write-back mount
+ */
+void *backWriter(void *arg) {
+    long t = (long)arg;
+    char name[9];
+    char buf[BACK_SIZE];
+    char rdBuf[BACK_SIZE];
+
+    snprintf(name, sizeof(name), "b%ld", t);
+    fileDescriptor fd = tfs_openFile(name);
+    memset(buf, '-', sizeof(buf));
+    tfs_writeFile(fd, buf, sizeof(buf));
+    for (int i = 0; i < BACK_ROUNDS; i++) {
+        int off = (i * 53 + t * 7) % (BACK_SIZE / 2);
+        int n = 1 + (i * 31) % (BACK_SIZE / 2);
+
+        memset(buf, 'a' + (i + t) % 26, n);
+        int res = tfs_pwrite(fd, buf, n, off);
+        if (res < 0) {
+            fail("pwrite", t, i, res);
+            continue;
+        }
+        tfs_seek(fd, off);
+        res = tfs_read(fd, rdBuf, n);
+        if (res != n || memcmp(rdBuf, buf, n) != 0) {
+            fail("read after pwrite", t, i, res);
+        }
+    }
+    tfs_closeFile(fd);
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[2 * NUM_THREADS + 2];
+    char shared[SHARED_SIZE];
+
+    if (tfs_mkfs("stressDisk", DMAP_SIZE * BLOCKSIZE) < 0 ||
+        tfs_mount("stressDisk") < 0) {
+        printf("> Failed to make disk\n");
+        return 1;
+    }
+    memset(shared, 's', sizeof(shared));
+    fileDescriptor fd = tfs_openFile("shared");
+    tfs_writeFile(fd, shared, sizeof(shared));
+
+    /* Writers, readers, the looker and the renamer at once */
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, writer, (void *)i);
+        pthread_create(&threads[NUM_THREADS + i], NULL, reader, (void *)i);
+    }
+    pthread_create(&threads[2 * NUM_THREADS], NULL, renamer, NULL);
+    pthread_create(&threads[2 * NUM_THREADS + 1], NULL, looker, NULL);
+    for (int i = 0; i < 2 * NUM_THREADS + 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    tfs_closeFile(fd);
+    tfs_unmount();
+
+    /* Write-back writers, reads race the flusher */
+    if (tfs_mountOpts("stressDisk", TFS_WRITEBACK) < 0) {
+        printf("> Failed to mount disk with write-back\n");
+        return 1;
+    }
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, backWriter, (void *)i);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    tfs_unmount();
+    printf("] Locking stress: %d error(s)\n", errors);
+    return errors > 0;
+}
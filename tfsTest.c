@@ -40,6 +40,9 @@ int main() {
     int i;
     int returnValue;
 
+    /* print what each call did */
+    tfs_setLogLevel(TFS_LOG_INFO);
+
     /* try to mount the disk */
     if (tfs_mount(DEFAULT_DISK_NAME) < 0) /* if mount fails */
     {
@@ -0,0 +1,351 @@
+/* TinyFS consistency checker
+ *
+ * Checks a disk image offline: the super block disk map against the type
+ * byte of every block, every inode's run of file context blocks, and that
+ * no two inodes claim the same block. Headerless file context blocks have
+ * no type byte and are only checked through their inode. The block range
+ * is split across a pool of worker threads that each read their own slice
+ * of the disk.
+ *
+ * Usage: tfsck [-r] [-j threads] diskname
+ *   -r  repair the disk by rebuilding the disk map from the blocks
+ *   -j  number of worker threads (defaults to number of cores)
+ *
+ * Exit status: 0 no errors, 1 errors repaired, 4 errors left, 8 failure
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libTinyFS.h"
+
+// Per block problems found by workers
+#define BAD_TYPE 0x01   // type byte does not match disk map
+#define BAD_MNUM 0x02   // magic number missing on used block
+#define BAD_MAP 0x04    // disk map entry is not S,I,C or F
+#define BAD_POS 0x08    // inode posInDsk does not match its block
+#define BAD_RUN 0x10    // inode run leaves disk or has non 'C' blocks
+#define BAD_SIZE 0x20   // inode fSize does not fit fcbLen
+#define OVERLAP 0x40    // block claimed by more than one inode
+#define ORPHAN 0x80     // file context block with no inode
+
+typedef struct CheckJob {
+    char *diskname;
+    SuperBlock *sBlock;
+    int lo;             // first block to check
+    int hi;             // one past last block to check
+    uint8_t *errs;      // per block problems
+    uint8_t *fcbLens;   // run length of each inode block
+    uint8_t *layouts;   // fcb layout of each inode block
+    char *heads;        // first two bytes of each block
+    int status;         // 0 or error reading disk
+} CheckJob;
+
+/*
+ * Checks blocks [lo, hi) against the disk map. Each worker opens its
+ * own descriptor so reads do not share a file offset
+ */
+void *checkRange(void *arg) {
+    CheckJob *job = arg;
+    SuperBlock *sBlock = job->sBlock;
+    InodeBlock iBlock;
+    int diskFd;
+
+    if ((diskFd = openDisk(job->diskname, 0)) < 0) {
+        job->status = OPEN_DISK_ERR;
+        return NULL;
+    }
+
+    for (int i = job->lo; i < job->hi; i++) {
+        char map = sBlock->dMap[i];
+        uint8_t errs = 0;
+
+        if (readBlock(diskFd, i, &iBlock) < 0) {
+            job->status = READ_BLOCK_ERR;
+            break;
+        }
+
+        if (map == 'I') {
+            if (iBlock.type != 2) {
+                errs |= BAD_TYPE;
+            } else {
+                if (iBlock.posInDsk != i) {
+                    errs |= BAD_POS;
+                }
+                if (i + iBlock.fcbLen >= sBlock->numBlocks) {
+                    errs |= BAD_RUN;
+                } else {
+                    for (int j = i + 1; j <= i + iBlock.fcbLen; j++) {
+                        if (sBlock->dMap[j] != 'C') {
+                            errs |= BAD_RUN;
+                        }
+                    }
+                }
+                int room = FCB_ROOM(&iBlock);
+                if (iBlock.layout > LAYOUT_RAW ||
+                    iBlock.fSize > iBlock.fcbLen * room ||
+                    (iBlock.fcbLen > 0 &&
+                     iBlock.fSize <= (iBlock.fcbLen - 1) * room)) {
+                    errs |= BAD_SIZE;
+                }
+                job->fcbLens[i] = iBlock.fcbLen;
+                job->layouts[i] = iBlock.layout;
+            }
+        } else if (map == 'C') {
+            // type is checked once the owning inode's layout is known
+            job->heads[2 * i] = iBlock.type;
+            job->heads[2 * i + 1] = iBlock.mNum;
+        } else if (map == 'F') {
+            // never written blocks read back as zeros
+            if (iBlock.type != 4 && iBlock.type != 0) {
+                errs |= BAD_TYPE;
+            }
+        } else {
+            errs |= BAD_MAP;
+        }
+
+        if (map == 'I' && iBlock.mNum != 0x44) {
+            errs |= BAD_MNUM;
+        }
+        job->errs[i] = errs;
+    }
+
+    closeDisk(diskFd);
+    return NULL;
+}
+
+/*
+ * Runs workers over the whole disk and reports every problem found
+ * Returns number of problems or a negative error
+ */
+int checkDisk(char *diskname, SuperBlock *sBlock, int numThreads) {
+    int numBlocks = sBlock->numBlocks;
+    int numErrs = 0;
+    int numFree = 0;
+    uint8_t errs[DMAP_SIZE];
+    uint8_t fcbLens[DMAP_SIZE];
+    uint8_t layouts[DMAP_SIZE];
+    char heads[2 * DMAP_SIZE];
+    uint8_t owners[DMAP_SIZE];
+
+    memset(errs, 0, sizeof(errs));
+    memset(fcbLens, 0, sizeof(fcbLens));
+    memset(layouts, 0, sizeof(layouts));
+
+    /* Check super block itself */
+    if (sBlock->type != 1 || sBlock->dMap[0] != 'S') {
+        printf("> Block 0: super block type or disk map entry is invalid\n");
+        numErrs++;
+    }
+
+    /* Split block range across workers */
+    if (numThreads > numBlocks - 1) {
+        numThreads = numBlocks - 1;
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+    pthread_t threads[numThreads];
+    int started[numThreads];
+    CheckJob jobs[numThreads];
+    int per = (numBlocks - 1 + numThreads - 1) / numThreads;
+
+    for (int t = 0; t < numThreads; t++) {
+        jobs[t].diskname = diskname;
+        jobs[t].sBlock = sBlock;
+        jobs[t].lo = 1 + t * per;
+        jobs[t].hi = jobs[t].lo + per < numBlocks ? jobs[t].lo + per
+                                                  : numBlocks;
+        jobs[t].errs = errs;
+        jobs[t].fcbLens = fcbLens;
+        jobs[t].layouts = layouts;
+        jobs[t].heads = heads;
+        jobs[t].status = 0;
+
+        // fall back to checking the range here if no thread is available
+        started[t] = pthread_create(&threads[t], NULL, checkRange,
+                                    &jobs[t]) == 0;
+        if (!started[t]) {
+            checkRange(&jobs[t]);
+        }
+    }
+    for (int t = 0; t < numThreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    for (int t = 0; t < numThreads; t++) {
+        if (jobs[t].status < 0) {
+            return jobs[t].status;
+        }
+    }
+
+    /* Claim file context blocks for each inode to find overlaps */
+    memset(owners, 0, sizeof(owners));
+    for (int i = 1; i < numBlocks; i++) {
+        if (sBlock->dMap[i] != 'I' || (errs[i] & (BAD_TYPE | BAD_RUN))) {
+            continue;
+        }
+        for (int j = i + 1; j <= i + fcbLens[i]; j++) {
+            if (owners[j] != 0) {
+                errs[j] |= OVERLAP;
+            }
+            owners[j] = i;
+        }
+    }
+    for (int i = 1; i < numBlocks; i++) {
+        if (sBlock->dMap[i] == 'C' && owners[i] == 0) {
+            errs[i] |= ORPHAN;
+        }
+        if (sBlock->dMap[i] == 'C' && owners[i] != 0 &&
+            layouts[owners[i]] != LAYOUT_RAW) {
+            if (heads[2 * i] != 3) {
+                errs[i] |= BAD_TYPE;
+            }
+            if (heads[2 * i + 1] != 0x44) {
+                errs[i] |= BAD_MNUM;
+            }
+        }
+        if (sBlock->dMap[i] == 'F') {
+            numFree++;
+        }
+    }
+
+    /* Report problems in block order */
+    for (int i = 1; i < numBlocks; i++) {
+        if (errs[i] == 0) {
+            continue;
+        }
+        numErrs++;
+        printf("> Block %d ('%c'):", i, sBlock->dMap[i]);
+        if (errs[i] & BAD_MAP) printf(" invalid disk map entry;");
+        if (errs[i] & BAD_TYPE) printf(" type byte does not match map;");
+        if (errs[i] & BAD_MNUM) printf(" bad magic number;");
+        if (errs[i] & BAD_POS) printf(" posInDsk is stale;");
+        if (errs[i] & BAD_RUN) printf(" file context run is broken;");
+        if (errs[i] & BAD_SIZE) printf(" fSize does not fit fcbLen;");
+        if (errs[i] & OVERLAP) printf(" claimed by more than one inode;");
+        if (errs[i] & ORPHAN) printf(" not owned by any inode;");
+        printf("\n");
+    }
+
+    if (sBlock->state == SB_CLEAN && sBlock->numFree != numFree) {
+        printf("> Super block free count %d, disk map has %d\n",
+               sBlock->numFree, numFree);
+        numErrs++;
+    }
+
+    return numErrs;
+}
+
+/*
+ * Overwrites blocks the disk map holds as free but that still
+ * carry an inode or file context type byte
+ */
+int stampFree(int diskFd, SuperBlock *sBlock) {
+    FreeBlock fBlock;
+    char buf[BLOCKSIZE];
+
+    for (int i = 1; i < sBlock->numBlocks; i++) {
+        if (sBlock->dMap[i] != 'F') {
+            continue;
+        }
+        if (readBlock(diskFd, i, buf) < 0) {
+            return READ_BLOCK_ERR;
+        }
+        if (buf[0] != 4 && buf[0] != 0) {
+            fBlock.type = 4;
+            fBlock.mNum = 0x44;
+            memset(fBlock.data, 0, sizeof(fBlock.data));
+            if (writeBlock(diskFd, i, &fBlock) < 0) {
+                return WRITE_BLOCK_ERR;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int repair = 0;
+    int numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int numErrs;
+    int opt;
+    int diskFd;
+    char *diskname;
+    SuperBlock sBlock;
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            repair = 1;
+        } else if (opt == 'j') {
+            numThreads = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-r] [-j threads] diskname\n", argv[0]);
+            return 8;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-r] [-j threads] diskname\n", argv[0]);
+        return 8;
+    }
+    diskname = argv[optind];
+
+    /* Read super block */
+    if ((diskFd = openDisk(diskname, 0)) < 0) {
+        printf("> Failed to open disk '%s'. Exited with status: %d\n",
+               diskname, OPEN_DISK_ERR);
+        return 8;
+    }
+    if (readBlock(diskFd, 0, &sBlock) < 0) {
+        printf("> Failed to read block. Exited with status: %d\n",
+               READ_BLOCK_ERR);
+        closeDisk(diskFd);
+        return 8;
+    }
+    if (sBlock.mNum != 0x44 || sBlock.numBlocks > DMAP_SIZE) {
+        printf("> '%s' is not a TinyFS disk. Exited with status: %d\n",
+               diskname, INVALID_MNUM_ERR);
+        closeDisk(diskFd);
+        return 8;
+    }
+
+    if ((numErrs = checkDisk(diskname, &sBlock, numThreads)) < 0) {
+        printf("> Failed to check disk. Exited with status: %d\n", numErrs);
+        closeDisk(diskFd);
+        return 8;
+    }
+    printf("] Checked '%s': %d blocks, %d problem(s)\n", diskname,
+           sBlock.numBlocks, numErrs);
+
+    if (numErrs == 0 || !repair) {
+        closeDisk(diskFd);
+        return numErrs == 0 ? 0 : 4;
+    }
+
+    /* Repair by rebuilding disk map from the blocks themselves */
+    if (rebuildFS(diskFd, &sBlock) < 0) {
+        printf("> Failed to repair disk. Exited with status: %d\n",
+               READ_BLOCK_ERR);
+        closeDisk(diskFd);
+        return 8;
+    }
+    if (stampFree(diskFd, &sBlock) < 0) {
+        printf("> Failed to write block. Exited with status: %d\n",
+               WRITE_BLOCK_ERR);
+        closeDisk(diskFd);
+        return 8;
+    }
+    sBlock.type = 1;
+    sBlock.state = SB_CLEAN;
+    if (writeSuperBlock(diskFd, &sBlock) < 0 || syncDisk(diskFd) < 0) {
+        printf("> Failed to write block. Exited with status: %d\n",
+               WRITE_BLOCK_ERR);
+        closeDisk(diskFd);
+        return 8;
+    }
+    closeDisk(diskFd);
+
+    numErrs = checkDisk(diskname, &sBlock, numThreads);
+    printf("] Repaired '%s': %d problem(s) left\n", diskname, numErrs);
+    return numErrs == 0 ? 1 : 4;
+}
@@ -17,5 +17,12 @@
 #define INVALID_SEEK_ERR -412
 #define READ_ONLY_ERR -413
 #define WRITE_BYTE_ERR -414
+#define MAP_FILE_ERR -415
+#define STREAM_ERR -416
+#define BATCH_ERR -417
+#define ASYNC_ERR -418
+#define NO_FILE_ERR -419
+#define DEFRAG_ERR -420
+#define RECORD_ERR -421
 
 #endif /* TINYFSERRNO_H*/
\ No newline at end of file